@@ -21,11 +21,13 @@ rlimit				core;
 fd_set				tester;
 time_t				currtime,lasttime;
 int					val,ret,x;
+int					started = 0;
 
 printf("[ CLASSD ] Untangle Traffic Classification Engine Version %s\n",VERSION);
 
 strcpy(g_cfgfile,"untangle-classd.conf");
 gettimeofday(&g_runtime,NULL);
+g_clock = time(NULL);
 load_configuration();
 
 // set the core dump file size limit
@@ -107,42 +109,111 @@ sysmessage(LOG_NOTICE,"STARTUP Untangle CLASSd %d-Bit Version %s Build %s\n",(in
 
 if (g_console != 0) sysmessage(LOG_NOTICE,"Running on console - Use ENTER or CTRL+C to terminate\n");
 
-	// We only need the message queue, session table, and classify thread
+// create the memory pools for message wagons
+MessageWagon::CreatePools();
+
+// create the slab backed memory pool for session objects
+g_sessionpool = new MemoryPool("Session",sizeof(SessionObject),64,64,SLAB_SIZE);
+
+// create the epoch manager used to free objects the session table
+// and network threads might still be using
+g_epochmanager = new EpochManager();
+
+// create the table of application and protochain names
+g_stringtable = new StringTable(STRING_LIMIT);
+
+	// We only need the message queues, session table, and classify threads
 	// when running on NGFW platforms. For MFW we initialize and call the
 	// NAVL classify function directly from the network handler thread
 	if (g_mfwflag == 0)
 	{
-	// create the main message queue
-	sysmessage(LOG_INFO,"Creating system message queue\n");
-	g_messagequeue = new MessageQueue();
+	// figure out how many classify threads we should be running
+	g_classify_count = cfg_classify_threads;
+	if (g_classify_count < 1) g_classify_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (g_classify_count < 1) g_classify_count = 1;
+	if (g_classify_count > 32) g_classify_count = 32;
+
+	// create a message queue for each classify thread and divide the
+	// configured packet maximum evenly between all of the queues
+	sysmessage(LOG_INFO,"Creating %d system message queues\n",g_classify_count);
+	g_messagequeue = (MessageQueue **)calloc(g_classify_count,sizeof(MessageQueue *));
+	for(x = 0;x < g_classify_count;x++) g_messagequeue[x] = new MessageQueue(cfg_packet_maximum / g_classify_count);
+
+	// create our session table using the configured implementation
+	if (strcasecmp(cfg_session_table,"flat") == 0)
+	{
+	sysmessage(LOG_INFO,"Creating session flat table\n");
+	g_sessiontable = new FlatTable(cfg_hash_buckets);
+	}
 
-	// create our session table
+	else
+	{
 	sysmessage(LOG_INFO,"Creating session hash table\n");
 	g_sessiontable = new HashTable(cfg_hash_buckets);
+	}
+
+	// create the timer wheel used to expire stale sessions
+	g_timerwheel = new TimerWheel(g_clock);
 
-	// start the vineyard classification thread
+	// start the vineyard classification threads
+	g_classify_tid = (pthread_t *)calloc(g_classify_count,sizeof(pthread_t));
 	sem_init(&g_classify_sem,0,0);
 	pthread_attr_init(&attr);
 	pthread_attr_setstacksize(&attr,g_stacksize);
-	ret = pthread_create(&g_classify_tid,NULL,classify_thread,NULL);
-	pthread_attr_destroy(&attr);
 
-		if (ret != 0)
+		for(started = 0;started < g_classify_count;started++)
 		{
-		sysmessage(LOG_ERR,"Error %d returned from pthread_create(classify)\n",ret);
-		g_shutdown = 1;
+		ret = pthread_create(&g_classify_tid[started],NULL,classify_thread,(void *)(intptr_t)started);
+
+			if (ret != 0)
+			{
+			sysmessage(LOG_ERR,"Error %d returned from pthread_create(classify)\n",ret);
+			g_shutdown = 1;
+			break;
+			}
+
+		// wait for the thread to signal init complete
+		sem_wait(&g_classify_sem);
 		}
 
-	// wait for the thread to signal init complete
-	sem_wait(&g_classify_sem);
+	pthread_attr_destroy(&attr);
+
+		// create the shared result table after the classify threads
+		// have loaded the protocol names that get copied to the table
+		if ((cfg_result_table[0] != 0) && (g_shutdown == 0))
+		{
+			try
+			{
+			g_resulttable = new ResultTable(cfg_result_table,cfg_result_entries);
+			}
+
+			catch(Problem *err)
+			{
+			if (err->string != NULL) sysmessage(LOG_ERR,"%s CODE:%d\n",err->string,err->value);
+			delete(err);
+			g_resulttable = NULL;
+			}
+		}
 	}
 
-// create the network server
-g_netserver = new NetworkServer();
-g_netserver->BeginExecution();
+// figure out how many network server threads we should be running
+g_netserver_count = cfg_io_threads;
+if (g_netserver_count < 1) g_netserver_count = sysconf(_SC_NPROCESSORS_ONLN);
+if (g_netserver_count < 1) g_netserver_count = 1;
+if (g_netserver_count > 32) g_netserver_count = 32;
+
+// create the optional local sockets which all of the servers share
+g_streamsock = g_packetsock = -1;
+if (cfg_stream_socket[0] != 0) g_streamsock = NetworkServer::CreateLocalSocket(SOCK_STREAM,cfg_stream_socket);
+if (cfg_packet_socket[0] != 0) g_packetsock = NetworkServer::CreateLocalSocket(SOCK_SEQPACKET,cfg_packet_socket);
+
+// create the network servers and start them all once they are created
+g_netserver = (NetworkServer **)calloc(g_netserver_count,sizeof(NetworkServer *));
+for(x = 0;x < g_netserver_count;x++) g_netserver[x] = new NetworkServer(x);
+for(x = 0;x < g_netserver_count;x++) g_netserver[x]->BeginExecution();
 
 // initialize cleanup timers
-currtime = lasttime = time(NULL);
+currtime = lasttime = g_clock = time(NULL);
 
 	while (g_shutdown == 0)
 	{
@@ -163,20 +234,27 @@ currtime = lasttime = time(NULL);
 		sleep(1);
 		}
 
-	// periodically perform maintenance and cleanup
+	// Update the coarse clock used by the session timeouts and message
+	// timestamps so the other threads don't have to read the clock for
+	// every packet.  One second resolution is all any of them need.
 	currtime = time(NULL);
+	g_clock = currtime;
+
+	// free any retired objects that nobody can be using anymore
+	g_epochmanager->ReclaimObjects();
+
+		// expire stale sessions every second but we only have a
+		// session table when the mfwflag is not set
+		if (g_mfwflag == 0)
+		{
+		ret = g_timerwheel->AdvanceWheel(currtime);
+		if (ret != 0) LOGMESSAGE(CAT_LOGIC,LOG_DEBUG,"Removed %d stale objects from session table\n",ret);
+		}
 
+		// periodically perform maintenance and cleanup
 		if (currtime > (lasttime + 60))
 		{
 		lasttime = currtime;
-
-			// we only do hashtable cleanup when the mfwflag is not set
-			if (g_mfwflag == 0)
-			{
-			ret = g_sessiontable->PurgeStaleObjects(currtime);
-			LOGMESSAGE(CAT_LOGIC,LOG_DEBUG,"Removed %d stale objects from session table\n",ret);
-			}
-
 		if (g_nolimit == 0) periodic_checkup();
 		}
 
@@ -190,31 +268,64 @@ currtime = lasttime = time(NULL);
 // set the global shutdown flag
 g_shutdown = 1;
 
-// cleanup the network server
-delete(g_netserver);
+// cleanup the network servers
+for(x = 0;x < g_netserver_count;x++) delete(g_netserver[x]);
+free(g_netserver);
+
+// every server thread has been joined so we can close the local sockets
+// and remove the socket files from the filesystem
+if (g_streamsock >= 0) close(g_streamsock);
+if (g_packetsock >= 0) close(g_packetsock);
+if ((g_streamsock >= 0) && (cfg_stream_socket[0] != '@')) unlink(cfg_stream_socket);
+if ((g_packetsock >= 0) && (cfg_packet_socket[0] != '@')) unlink(cfg_packet_socket);
 
 	if (g_mfwflag == 0)
 	{
-	// post a shutdown message to the main message queue
-	g_messagequeue->PushMessage(new MessageWagon(MSG_SHUTDOWN));
+	// post a shutdown message to each of the classify message queues
+	for(x = 0;x < g_classify_count;x++) g_messagequeue[x]->PushMessage(new MessageWagon(MSG_SHUTDOWN));
 
 	// the five second alarm gives all threads time to shut down cleanly
 	// if any get stuck the abort() in the signal handler should do the trick
 	if (g_nolimit == 0) alarm(5);
-	pthread_join(g_classify_tid,NULL);
+	for(x = 0;x < started;x++) pthread_join(g_classify_tid[x],NULL);
 	if (g_nolimit == 0) alarm(0);
 
 	// clean up the thread semaphores
 	sem_destroy(&g_classify_sem);
+	free(g_classify_tid);
 
 	// cleanup all the global objects we created
+	delete(g_timerwheel);
+
 	sysmessage(LOG_INFO,"Deleting session hash table\n");
 	delete(g_sessiontable);
 
-	sysmessage(LOG_INFO,"Deleting system message queue\n");
-	delete(g_messagequeue);
+		// the classify threads are finished so nothing else
+		// will be published to the result table
+		if (g_resulttable != NULL)
+		{
+		sysmessage(LOG_INFO,"Deleting shared result table\n");
+		delete(g_resulttable);
+		g_resulttable = NULL;
+		}
+
+	sysmessage(LOG_INFO,"Deleting system message queues\n");
+	for(x = 0;x < g_classify_count;x++) delete(g_messagequeue[x]);
+	free(g_messagequeue);
 	}
 
+// free everything still waiting to be reclaimed
+delete(g_epochmanager);
+
+// cleanup the table of application and protochain names
+delete(g_stringtable);
+
+// cleanup the memory pool for session objects
+delete(g_sessionpool);
+
+// cleanup the memory pools for message wagons
+MessageWagon::DeletePools();
+
 sysmessage(LOG_NOTICE,"GOODBYE Untangle CLASSd Version %s Build %s\n",VERSION,BUILDID);
 
 	if (g_console == 0)
@@ -532,9 +643,22 @@ cfg_skype_require_history = atoi(work);
 grab_config_item(filedata,"CLASSD_SKYPE_SEQ_CACHE_TIME",work,sizeof(work),"30000");
 cfg_skype_seq_cache_time = atoi(work);
 
-grab_config_item(filedata,"CLASSD_HASH_BUCKETS",work,sizeof(work),"99991");
+grab_config_item(filedata,"CLASSD_HASH_BUCKETS",work,sizeof(work),"1024");
 cfg_hash_buckets = atoi(work);
 
+grab_config_item(filedata,"CLASSD_SESSION_TABLE",cfg_session_table,sizeof(cfg_session_table),"chain");
+
+grab_config_item(filedata,"CLASSD_CLASSIFY_THREADS",work,sizeof(work),"0");
+cfg_classify_threads = atoi(work);
+
+grab_config_item(filedata,"CLASSD_IO_THREADS",work,sizeof(work),"1");
+cfg_io_threads = atoi(work);
+
+grab_config_item(filedata,"CLASSD_RESULT_TABLE",cfg_result_table,sizeof(cfg_result_table),"");
+
+grab_config_item(filedata,"CLASSD_RESULT_ENTRIES",work,sizeof(work),"65536");
+cfg_result_entries = atoi(work);
+
 grab_config_item(filedata,"CLASSD_MEMORY_LIMIT",work,sizeof(work),"262144");
 cfg_mem_limit = atoi(work);
 
@@ -559,6 +683,9 @@ cfg_http_limit = atoi(work);
 grab_config_item(filedata,"CLASSD_CLIENT_PORT",work,sizeof(work),"8123");
 cfg_client_port = atoi(work);
 
+grab_config_item(filedata,"CLASSD_STREAM_SOCKET",cfg_stream_socket,sizeof(cfg_stream_socket),"");
+grab_config_item(filedata,"CLASSD_PACKET_SOCKET",cfg_packet_socket,sizeof(cfg_packet_socket),"");
+
 grab_config_item(filedata,"CLASSD_PACKET_TIMEOUT",work,sizeof(work),"4");
 cfg_packet_timeout = atoi(work);
 
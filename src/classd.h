@@ -32,43 +32,135 @@ const unsigned char MSG_CLIENT		= 'C';
 const unsigned char MSG_SERVER		= 'S';
 const unsigned char MSG_PACKET		= 'P';
 const unsigned char MSG_SHUTDOWN	= 'X';
+
+const int CHUNK_MAXIMUM			= 0x10000;
+const int QUERY_MINIMUM			= 0x0400;
+const int QUERY_MAXIMUM			= 0x10000;
+const int REPLY_MINIMUM			= 0x8000;
+const int REPLY_BACKLOG			= 0x10000;
+const int EVENT_MAXIMUM			= 10000;
+const int LOOKUP_MAXIMUM		= 1024;
+const int RING_MINIMUM			= 0x10000;
+const int RING_MAXIMUM			= 0x4000000;
+const int RING_ALIGN			= 16;
+const unsigned int RING_MAGIC	= 0x474E4952;
+const unsigned int RESULT_MAGIC	= 0x544C5352;
+const int RESULT_PROBES			= 16;
+const int RESULT_CHAIN			= 23;
+const int HASH_SEGMENT			= 1024;
+const int HASH_DIRECTORY		= 16384;
+const int TABLE_HISTOGRAM		= 8;
+const int EPOCH_SLOTS			= 256;
+const int EPOCH_BATCH			= 256;
+const int TIMER_BITS			= 6;
+const int TIMER_SLOTS			= (1 << TIMER_BITS);
+const int TIMER_LEVELS			= 4;
+const int TIMER_RETRY			= 10;
+const int STRING_LIMIT			= 16384;
+const int CHAIN_MAXIMUM			= 128;
+const int STRING_OVERFLOW		= 0xFFFF;
+const int SLAB_SIZE				= 0x10000;
+const int SLAB_HISTOGRAM		= 5;
+const int FLAT_SHARDS			= 64;
+const int FLAT_GROUP			= 16;
+
+const unsigned char BIN_CREATE		= 0x01;
+const unsigned char BIN_REMOVE		= 0x02;
+const unsigned char BIN_CLIENT		= 0x03;
+const unsigned char BIN_SERVER		= 0x04;
+const unsigned char BIN_PACKET		= 0x05;
+const unsigned char BIN_LOOKUP		= 0x06;
+const unsigned char BIN_LOOKUP_BATCH	= 0x07;
+const unsigned char BIN_SUBSCRIBE	= 0x08;
+const unsigned char BIN_EVENT		= 0x09;
+const unsigned char BIN_REPLY		= 0x80;
+
+const unsigned char BIN_FLAG_NOREPLY	= 0x01;
+
+const unsigned short BIN_STATUS_OK		= 0;
+const unsigned short BIN_STATUS_EMPTY	= 1;
+const unsigned short BIN_STATUS_INVALID	= 2;
+const unsigned short BIN_STATUS_ERROR	= 3;
 /*--------------------------------------------------------------------------*/
 class NetworkServer;
 class NetworkClient;
+class PacketRing;
+class ResultTable;
 class MessageQueue;
 class MessageWagon;
+class MemoryPool;
+class EpochManager;
+class TimerWheel;
+class StringTable;
+struct SessionEvent;
+struct RingHeader;
+struct ResultHeader;
+struct ResultEntry;
 class SessionObject;
 class HashObject;
+class ObjectTable;
 class HashTable;
+class FlatTable;
 class WebServer;
 class Problem;
 /*--------------------------------------------------------------------------*/
+// Holds the classification of a raw packet under MFW where there is no
+// session table.  Each client has one that the vineyard callbacks fill
+// in with protocol indexes so the names are only looked up for a reply.
+
+struct PacketResult
+{
+	u_int64_t		session;
+	u_int8_t		protocol;
+	short			confidence;
+	short			state;
+	short			application;
+	u_int16_t		chain_length;
+	u_int16_t		protochain[RESULT_CHAIN];
+	char			detail[256];
+};
+/*--------------------------------------------------------------------------*/
 class NetworkServer
 {
 public:
 
-	NetworkServer(void);
+	NetworkServer(int aIndex);
 	virtual ~NetworkServer(void);
 
 	void BeginExecution(void);
 
+	static int CreateLocalSocket(int aType,const char *aPath);
+
 private:
 
 	static void* ThreadMaster(void *arg);
 	void* ThreadWorker(void);
+	void AcceptClients(int aSock);
+	void HandleEvents(void);
 	void InsertClient(NetworkClient *aClient);
 	void RemoveClient(NetworkClient *aClient);
+	void PurgeClients(void);
 
 	NetworkClient			*ClientList;
+	NetworkClient			*DeadList;
 	pthread_t				ThreadHandle;
 	sem_t					ThreadSignal;
+	int						serverindex;
+	int						eventsock;
+	int						pollsock;
 	int						netsock;
+	int						streamsock;
+	int						packetsock;
 };
 /*--------------------------------------------------------------------------*/
 class NetworkClient
 {
 friend class NetworkServer;
 
+public:
+
+	static void PublishEvent(SessionObject *aSession);
+
 protected:
 
 	NetworkClient(int aSock);
@@ -77,16 +169,43 @@ protected:
 	int NetworkHandler(void);
 
 	NetworkClient			*next;
+	NetworkClient			*prev;
 	struct sockaddr_in		netaddr;
 	char					netname[32];
-	char					querybuff[1024];
-	char					replybuff[0x8000];
+	char					*querybuff;
+	char					*replybuff;
 	int						queryoff;
 	int						replyoff;
 	int						dataloc;
 	int						datalen;
+	int						replysent;
+	int						replysize;
+	int						querysize;
+	int						binarymode;
+	int						binaryopcode;
+	int						noreply;
+	int						quietflag;
+	int						packetmode;
+	int						deadflag;
 	int						netsock;
 
+	PacketRing				*packetring;
+	int						passfd[2];
+	int						passcount;
+
+	MessageWagon			*chunkwagon;
+	PacketResult			chunkresult;
+	int						chunkoff;
+
+	NetworkClient			*nextsub;
+	NetworkClient			*nextready;
+	SessionEvent			*eventhead;
+	SessionEvent			*eventtail;
+	SessionEvent			*eventready;
+	int						eventcount;
+	int						eventsock;
+	int						subscribed;
+
 private:
 
 	void BuildConfiguration(void);
@@ -95,35 +214,119 @@ private:
 	void BuildHelpPage(void);
 	void DumpEverything(void);
 	void AdjustLogCategory(void);
+	int ReceivePacket(int size);
+	int ReceiveData(char *target,int size);
+	void DiscardPassed(void);
+	void HandleShmring(void);
+	int HandleCommand(void);
 	void HandleCreate(void);
 	void HandleRemove(void);
+	void HandleLookup(void);
+	void Subscribe(void);
+	void Unsubscribe(void);
+	void FormatEvents(void);
+
+	static NetworkClient* GrabEvents(int aEventsock);
 
 	u_int64_t ExtractNetworkSession(const char *argBuffer);
-	SessionObject* HandleChunk(u_int8_t argMessage);
+	int CreateSession(u_int64_t hashcode,u_int16_t protocol,navl_host_t *client,navl_host_t *server);
+	int RemoveSession(u_int64_t hashcode);
+	int HandleChunk(u_int8_t argMessage);
+	int BeginChunk(u_int8_t argMessage,u_int64_t hashcode,int rawproto,long length);
+	void CompleteChunk(void);
+	void BuildLookupReply(SessionObject *local,u_int64_t hashcode,const char *argQuery);
+	void BuildPacketReply(PacketResult *argResult);
+	void BuildResultReply(u_int64_t hashcode,const char *application,const char *protochain,const char *detail,int confidence,int state);
+
+	int ProcessBinary(void);
+	void BuildBinaryReply(int argStatus,u_int64_t argSession,const void *argPayload,int argLength);
+	void BuildBinaryResult(u_int64_t hashcode,const char *application,const char *protochain,const char *detail,int confidence,int state);
 
 	int ProcessRequest(void);
 	int TransmitReply(void);
+	void ReserveReply(int argSize);
+	int GrowQuery(int argSize);
+};
+/*--------------------------------------------------------------------------*/
+class PacketRing
+{
+public:
+
+	PacketRing(int aMemory,int aSignal,const char *aName);
+	virtual ~PacketRing(void);
+
+	void BeginExecution(void);
+
+private:
+
+	static void* ThreadMaster(void *arg);
+	void* ThreadWorker(void);
+	int ConsumeRecords(void);
+	void WaitRecords(void);
+
+	RingHeader				*ringhead;
+	char					*ringdata;
+	size_t					ringsize;
+	u_int64_t				ringmask;
+	u_int64_t				tailpos;
+	pthread_t				ThreadHandle;
+	sem_t					ThreadSignal;
+	int						memsock;
+	int						signalsock;
+	char					ringname[32];
+};
+/*--------------------------------------------------------------------------*/
+class ResultTable
+{
+public:
+
+	ResultTable(const char *aPath,int aEntries);
+	virtual ~ResultTable(void);
+
+	void UpdateResult(u_int64_t aSession,int aApplication,const u_int16_t *aChain,int aLength,int aConfidence,int aState);
+	void RemoveResult(u_int64_t aSession);
+
+private:
+
+	ResultEntry *FindEntry(u_int64_t aSession,u_int64_t aMatch);
+	void WriteEntry(ResultEntry *aEntry,u_int64_t aSession,int aApplication,const u_int16_t *aChain,int aLength,int aConfidence,int aState);
+
+	ResultHeader			*tablehead;
+	ResultEntry				*tabledata;
+	size_t					tablesize;
+	u_int64_t				tablemask;
+	int						tableshift;
+	char					tablepath[256];
 };
 /*--------------------------------------------------------------------------*/
 class MessageQueue
 {
 public:
 
-	MessageQueue(void);
+	MessageQueue(int aLimit);
 	virtual ~MessageQueue(void);
 
 	void PushMessage(MessageWagon *argObject);
 	MessageWagon *GrabMessage(void);
+	int GrabBatch(MessageWagon **argList,int argMaximum);
 	void GetQueueSize(int &aCurr_count,int &aCurr_bytes,int &aHigh_count,int &aHigh_bytes);
 
-	sem_t					MessageSignal;
-
 private:
 
-	pthread_mutex_t			ListLock;
-	MessageWagon			*ListHead;
-	MessageWagon			*ListTail;
-	int						curr_count;
+	int PullBatch(MessageWagon **argList,int argMaximum);
+
+	// The producer and consumer positions are separated by padding so the
+	// netserver and classify threads are not fighting over a cache line.
+	MessageWagon			**ring;
+	unsigned				ringmask;
+	int						limit;
+	char					pad1[64];
+	unsigned				pushpos;
+	char					pad2[64];
+	unsigned				pullpos;
+	int						sleeping;
+	int						spinlimit;
+	char					pad3[64];
 	int						curr_bytes;
 	int						high_count;
 	int						high_bytes;
@@ -131,16 +334,25 @@ private:
 /*--------------------------------------------------------------------------*/
 class MessageWagon
 {
-friend class MessageQueue;
-
 public:
 
 	MessageWagon(u_int8_t argCommand,u_int64_t argIndex,const void *argBuffer,int argLength);
+	MessageWagon(u_int8_t argCommand,u_int64_t argIndex,int argLength);
 	MessageWagon(u_int8_t argCommand,const char *argString);
 	MessageWagon(u_int8_t argCommand,u_int64_t argIndex);
 	MessageWagon(u_int8_t argCommand);
 	virtual ~MessageWagon(void);
 
+	// wagons and their payload come from the wagon pools so use
+	// new(length) to reserve inline space for the payload data
+	static void *operator new(size_t aSize,int aExtra);
+	static void *operator new(size_t aSize);
+	static void operator delete(void *aObject,int aExtra);
+	static void operator delete(void *aObject);
+
+	static void CreatePools(void);
+	static void DeletePools(void);
+
 	u_int64_t				index;
 	u_int8_t				command;
 	time_t					timestamp;
@@ -149,10 +361,249 @@ public:
 
 private:
 
-	MessageWagon			*next;
+	void *GrabPayload(int argLength);
+};
+/*--------------------------------------------------------------------------*/
+class MemoryPool
+{
+public:
+
+	MemoryPool(const char *aName,int aBlockSize,int aMagazine,int aRetain,int aSlabSize = 0);
+	virtual ~MemoryPool(void);
+
+	void *GrabBlock(void);
+	void FreeBlock(void *aBlock);
+	void GetPoolStats(u_int64_t &aHits,u_int64_t &aMisses,int &aIdle);
+	void GetSlabStats(int &aCount,int &aBytes,int *aHistogram);
+
+	inline const char *GetPoolName(void) { return(poolname); }
+	inline int GetBlockSize(void) { return(blocksize); }
+
+private:
+
+	struct PoolCache
+	{
+		MemoryPool			*pool;
+		PoolCache			*next;
+		void				*list;
+		int					count;
+		u_int64_t			hits;
+		u_int64_t			misses;
+	};
+
+	struct PoolSlab
+	{
+		PoolSlab			*next;
+		PoolSlab			*prev;
+		void				*freelist;
+		int					carved;
+		int					used;
+	};
+
+	static void FreeCache(void *aCache);
+	PoolCache *GetCache(void);
+	void FlushMagazine(PoolCache *aCache,int aCount);
+	void *AllocateBlock(void);
+	void ReleaseBlock(void *aBlock);
+	void LinkSlab(PoolSlab **aList,PoolSlab *aSlab);
+	void UnlinkSlab(PoolSlab **aList,PoolSlab *aSlab);
+
+	pthread_key_t			cachekey;
+	pthread_mutex_t			depotlock;
+	pthread_mutex_t			slablock;
+	PoolCache				*cachelist;
+	PoolSlab				*partiallist;
+	PoolSlab				*fulllist;
+	void					*depotlist;
+	int						depotcount;
+	int						blocksize;
+	int						magazine;
+	int						retain;
+	int						slabsize;
+	int						slabblocks;
+	int						slabcount;
+	u_int64_t				hitcount;
+	u_int64_t				misscount;
+	char					poolname[16];
+};
+/*--------------------------------------------------------------------------*/
+// Epoch based reclamation lets the session tables be searched without any
+// locks.  Readers enter an epoch before they look at the table and leave it
+// once they are finished with whatever they found.  Objects removed from
+// the table are retired instead of deleted and only freed once every
+// thread that might still be using them has left the epoch.
+
+class EpochManager
+{
+public:
+
+	EpochManager(void);
+	virtual ~EpochManager(void);
+
+	void EnterEpoch(void);
+	void LeaveEpoch(void);
+	void RetireObject(HashObject *aObject);
+	void RetireMemory(void *aMemory);
+	int ReclaimObjects(void);
+	void GetEpochStats(u_int64_t &aEpoch,int &aPending,u_int64_t &aFreed);
+
+private:
+
+	// each slot is padded to a cache line so readers don't share lines
+	struct EpochSlot
+	{
+		u_int64_t			active;
+		int					depth;
+		int					owner;
+		char				pad[48];
+	};
+
+	struct RetireItem
+	{
+		RetireItem			*next;
+		HashObject			*object;
+		void				*memory;
+		u_int64_t			epoch;
+	};
+
+	static void FreeSlot(void *aSlot);
+	EpochSlot *GetSlot(void);
+	void InsertItem(RetireItem *aItem);
+	void ReleaseItem(RetireItem *aItem);
+
+	EpochSlot				slots[EPOCH_SLOTS];
+	pthread_key_t			slotkey;
+	pthread_mutex_t			retirelock;
+	RetireItem				*retirelist;
+	u_int64_t				globalepoch;
+	u_int64_t				freedcount;
+	int						retirecount;
+};
+/*--------------------------------------------------------------------------*/
+// The application and protochain names are kept in an append only table
+// so each session only needs to store a small id for each one.  Strings
+// are never changed or removed so the ids can be turned back into strings
+// without any locks.  Protochains are also indexed by the sequence of
+// protocol indexes vineyard gives us so the classify threads can find
+// the id without building the string on every callback.
+
+class StringTable
+{
+public:
+
+	StringTable(int aLimit);
+	virtual ~StringTable(void);
+
+	u_int16_t InsertString(const char *aString);
+	u_int16_t InsertChain(const u_int16_t *aChain,int aLength,char *aBuffer,int aSize);
+	void GetTableSize(int &aCount,int &aBytes);
+
+	inline u_int64_t GetOverflowCount(void) { return(__atomic_load_n(&overflowcount,__ATOMIC_RELAXED)); }
+
+	inline const char *GetString(u_int16_t aIndex) { return(stringlist[aIndex]); }
+
+private:
+
+	struct ChainEntry
+	{
+		u_int16_t			string;
+		u_int16_t			length;
+		u_int16_t			chain[1];
+	};
+
+	u_int32_t GetHashValue(const char *aString);
+	u_int32_t GetChainHash(const u_int16_t *aChain,int aLength);
+	int FindString(const char *aString,u_int32_t aHash);
+	int FindChain(const u_int16_t *aChain,int aLength,u_int32_t aHash);
+	void FormatChain(const u_int16_t *aChain,int aLength,char *aBuffer,int aSize);
+
+	pthread_mutex_t			stringlock;
+	char					**stringlist;
+	u_int32_t				*indexlist;
+	ChainEntry				**chainlist;
+	u_int32_t				*chainindex;
+	u_int32_t				indexmask;
+	int						stringlimit;
+	int						stringcount;
+	int						stringbytes;
+	int						chaincount;
+	int						chainbytes;
+	int						fullflag;
+	u_int64_t				overflowcount;
+};
+/*--------------------------------------------------------------------------*/
+// Sessions are expired by a hierarchical timer wheel that is advanced once
+// per second.  The bottom level has a slot for each second and each level
+// above has slots that span a full turn of the level below, so the work
+// done each second is proportional to the number of timers that fire.
+// Timers are set once when a session is created and traffic only updates
+// the session timeout, so a timer that fires for a session that is still
+// active is just put back in the wheel using the new timeout.
+
+class TimerWheel
+{
+public:
+
+	TimerWheel(time_t aStamp);
+	virtual ~TimerWheel(void);
+
+	void InsertTimer(HashObject *aObject);
+	int AdvanceWheel(time_t aStamp);
+	void GetWheelStats(int &aCount,u_int64_t &aExpired);
+
+private:
+
+	struct TimerEntry
+	{
+		TimerEntry			*next;
+		HashObject			*object;
+		u_int64_t			session;
+		time_t				expires;
+	};
+
+	void InsertEntry(TimerEntry *aEntry);
+	void CascadeLevel(int aLevel);
+	void RebaseWheel(time_t aStamp);
+	int ExpireEntries(TimerEntry *aList);
+
+	TimerEntry				*wheel[TIMER_LEVELS][TIMER_SLOTS];
+	pthread_mutex_t			wheellock;
+	time_t					wheeltime;
+	u_int64_t				expiredcount;
+	int						entrycount;
+};
+/*--------------------------------------------------------------------------*/
+// The session table interface which lets us choose between the
+// original chained hash table and the open addressing flat table.
+
+class ObjectTable
+{
+public:
+
+	inline ObjectTable(void) { }
+	inline virtual ~ObjectTable(void) { }
+
+	virtual int InsertObject(HashObject *aObject) = 0;
+	virtual int DeleteObject(HashObject *aObject) = 0;
+	virtual HashObject* SearchObject(u_int64_t aValue) = 0;
+
+	virtual void GetTableSize(int &aCount,int &aBytes) = 0;
+	virtual void GetLoadStats(int &aBuckets,double &aLoad,int *aHistogram) = 0;
+	virtual void DumpDetail(FILE *aFile) = 0;
 };
 /*--------------------------------------------------------------------------*/
-class HashTable
+// The chained table uses linear hashing so it can grow and shrink one
+// bucket at a time as the load changes.  Buckets are allocated in fixed
+// segments found through a directory so existing buckets and their locks
+// never move while the table grows.
+
+struct HashSegment
+{
+	HashObject		*table[HASH_SEGMENT];
+	pthread_mutex_t	control[HASH_SEGMENT];
+};
+/*--------------------------------------------------------------------------*/
+class HashTable : public ObjectTable
 {
 public:
 
@@ -164,21 +615,82 @@ public:
 	HashObject* SearchObject(u_int64_t aValue);
 
 	void GetTableSize(int &aCount,int &aBytes);
+	void GetLoadStats(int &aBuckets,double &aLoad,int *aHistogram);
+	void DumpDetail(FILE *aFile);
+
+private:
+
+	u_int64_t GetHashValue(u_int64_t aValue,u_int64_t aState);
+	unsigned LockBucket(u_int64_t aValue);
+	HashObject* SearchLocked(u_int64_t aValue);
+	unsigned GetBucketCount(u_int64_t aState);
+	void SplitBucket(void);
+	void MergeBucket(void);
+
+	inline HashObject* &Bucket(unsigned aKey)		{ return(directory[aKey / HASH_SEGMENT]->table[aKey % HASH_SEGMENT]); }
+	inline pthread_mutex_t *Control(unsigned aKey)	{ return(&directory[aKey / HASH_SEGMENT]->control[aKey % HASH_SEGMENT]); }
+
+	HashSegment				**directory;
+	pthread_mutex_t			resizelock;
+	u_int64_t				tablestate;
+	u_int32_t				resizeseq;
+	unsigned				basecount;
+	int						objcount;
+};
+/*--------------------------------------------------------------------------*/
+// Each shard is a Swiss table style open addressing table with its own
+// lock.  The control array holds one metadata byte for every slot that is
+// either empty, deleted, or seven bits of the hash for a full slot, so a
+// whole group of slots can be checked with a single SSE2 compare before we
+// touch the slot array which holds the session id and object pointer.
+
+struct FlatSlot
+{
+	u_int64_t		session;
+	HashObject		*object;
+};
+
+struct FlatShard
+{
+	pthread_mutex_t	lock;
+	u_int8_t		*control;
+	FlatSlot		*slots;
+	unsigned		groups;
+	unsigned		count;
+	unsigned		deleted;
+	u_int32_t		version;
+} __attribute__((aligned(64)));
+
+class FlatTable : public ObjectTable
+{
+public:
+
+	FlatTable(int aBuckets);
+	virtual ~FlatTable(void);
+
+	int InsertObject(HashObject *aObject);
+	int DeleteObject(HashObject *aObject);
+	HashObject* SearchObject(u_int64_t aValue);
+
+	void GetTableSize(int &aCount,int &aBytes);
+	void GetLoadStats(int &aBuckets,double &aLoad,int *aHistogram);
 	void DumpDetail(FILE *aFile);
-	int PurgeStaleObjects(time_t aStamp);
 
 private:
 
 	u_int64_t GetHashValue(u_int64_t aValue);
+	unsigned MatchGroup(const u_int8_t *aGroup,u_int8_t aValue);
+	int FindSlot(const u_int8_t *aControl,const FlatSlot *aSlots,unsigned aGroups,u_int64_t aHash,u_int64_t aValue);
+	void InsertSlot(FlatShard *aShard,u_int64_t aHash,u_int64_t aValue,HashObject *aObject);
+	void ResizeShard(FlatShard *aShard,unsigned aGroups);
 
-	HashObject				**table;
-	pthread_mutex_t			*control;
-	int						buckets;
+	FlatShard				*shards;
 };
 /*--------------------------------------------------------------------------*/
 class HashObject
 {
 friend class HashTable;
+friend class FlatTable;
 
 public:
 
@@ -187,9 +699,9 @@ public:
 
 	virtual void ResetTimeout(void);
 
-	inline const char *GetNetString(void) { return(netstring); }
 	inline u_int64_t GetNetSession(void) { return(netsession); }
 	inline u_int16_t GetNetProtocol(void) { return(netprotocol); }
+	inline time_t GetTimeout(void) { return(timeout); }
 
 	virtual char *GetObjectString(char *target,int maxlen) = 0;
 
@@ -200,10 +712,9 @@ protected:
 private:
 
 	HashObject				*next;
-	u_int16_t				netprotocol;
 	u_int64_t				netsession;
 	time_t					timeout;
-	char					netstring[24];
+	u_int16_t				netprotocol;
 };
 /*--------------------------------------------------------------------------*/
 class SessionObject : public HashObject
@@ -217,37 +728,48 @@ public:
 
 	virtual ~SessionObject(void);
 
+	// sessions come from the slab backed session pool
+	static void *operator new(size_t aSize);
+	static void operator delete(void *aObject);
+
 	void UpdateObject(const char *aApplication,
 		const char * aProtochain,
 		short aConfidence,
 		short aState);
 
+	void UpdateObject(u_int16_t aApplication,
+		u_int16_t aProtochain,
+		short aConfidence,
+		short aState);
+
 	void UpdateDetail(const char *aDetail);
 	char *GetObjectString(char *target,int maxlen);
 
-	inline const char *GetApplication(void)	{ return(application_str[application_idx]); }
-	inline const char *GetProtochain(void)	{ return(protochain_str[protochain_idx]); }
-	inline const char *GetDetail(void)		{ return(detail_str[detail_idx] == NULL ? "" : detail_str[detail_idx]); }
+	const char *GetApplication(void);
+	const char *GetProtochain(void);
+	const char *GetDetail(void);
 	inline short GetConfidence(void)		{ return(confidence); }
 	inline short GetState(void)				{ return(state); }
 
+	// The members are ordered so they pack into the space after the
+	// HashObject members and keep each session under 128 bytes.
 	navl_host_t				clientinfo;
 	navl_host_t				serverinfo;
 	navl_conn_t				vinestat;
-	int						wipeflag;
 
 private:
 
 	int GetObjectSize(void);
+	u_int16_t InternString(const char *aString,char **aCopy,int &aChanged);
+	void StoreObject(u_int16_t aApplication,u_int16_t aProtochain,short aConfidence,short aState,int aChanged);
 
 	short					state;
 	short					confidence;
-	char					application_str[2][16];
-	char					protochain_str[2][256];
-	char					detail_str[2][256];
-	int						application_idx;
-	int						protochain_idx;
-	int						detail_idx;
+	u_int16_t				application;
+	u_int16_t				protochain;
+	char					*detail;
+	char					*appcopy;
+	char					*chaincopy;
 };
 /*--------------------------------------------------------------------------*/
 class Problem
@@ -272,17 +794,140 @@ struct protostats
 {
 	u_int64_t	packet_count;
 	char		protocol_name[16];
+	u_int16_t	string_id;
+};
+/*--------------------------------------------------------------------------*/
+// Holds a snapshot of a session when the classification changes so it
+// can be passed from the classify thread to each subscribed client
+
+struct SessionEvent
+{
+	SessionEvent	*next;
+	u_int64_t		session;
+	short			confidence;
+	short			state;
+	char			application[16];
+	char			protochain[256];
+	char			detail[256];
+};
+/*--------------------------------------------------------------------------*/
+// A client switches to the binary protocol by sending the BINARY command.
+// After that every request and reply starts with this header.  The param
+// field holds the raw protocol for PACKET requests and the status in all
+// replies.  Setting BIN_FLAG_NOREPLY in the flags of a CREATE, REMOVE, or
+// chunk request tells us not to send a reply.  SUBSCRIBE with param set
+// to one or zero turns classification events on or off, and each event
+// is sent as an EVENT reply with a lookup result payload.  The length is
+// the size of the payload following the header.  All integer fields are
+// in host byte order since the protocol is only used for local connections.
+
+struct BinaryHeader
+{
+	u_int8_t	opcode;
+	u_int8_t	flags;
+	u_int16_t	param;
+	u_int32_t	length;
+	u_int64_t	session;
+} __attribute__((packed));
+
+// Payload for the CREATE request.  The family is 4 or 6 and the ports
+// and addresses are in network byte order.  IPv4 addresses use the
+// first four bytes of the address fields.
+
+struct BinaryCreate
+{
+	u_int8_t	protocol;
+	u_int8_t	family;
+	u_int16_t	client_port;
+	u_int16_t	server_port;
+	u_int16_t	spare;
+	u_int8_t	client_addr[16];
+	u_int8_t	server_addr[16];
+} __attribute__((packed));
+
+// Payload for a lookup result.  The application, protochain, and detail
+// strings follow the structure in that order without null terminators.
+
+struct BinaryResult
+{
+	u_int8_t	state;
+	u_int8_t	confidence;
+	u_int8_t	application_length;
+	u_int8_t	spare;
+	u_int16_t	protochain_length;
+	u_int16_t	detail_length;
+} __attribute__((packed));
+
+// A local client can send the SHMRING command on an AF_UNIX connection
+// with a memfd and an eventfd attached as SCM_RIGHTS to submit chunks
+// through shared memory.  The memfd holds this header followed by size
+// bytes of ring data where size is a power of two.  Each record is a
+// BinaryHeader with the CLIENT, SERVER, or PACKET opcode followed by the
+// chunk data and padded to a multiple of RING_ALIGN.  A record with a zero
+// opcode means skip to the start of the ring.  The producer advances head
+// after writing each record and we advance tail after reading it.  Before
+// waiting on the eventfd we set sleeping and check head again, so after
+// advancing head the producer must clear sleeping and write the eventfd
+// if it finds it set.  The positions are free running byte counters.
+
+struct RingHeader
+{
+	u_int32_t	magic;
+	u_int32_t	size;
+	char		pad1[56];
+	u_int64_t	head;
+	char		pad2[56];
+	u_int64_t	tail;
+	char		pad3[56];
+	u_int32_t	sleeping;
+	char		pad4[60];
+};
+
+// When CLASSD_RESULT_TABLE is set the classify threads publish the latest
+// result for every session in a shared file that local readers can map
+// and poll without making a request.  The file holds this header, then
+// the entries, then a 16 byte name for each protocol id.  The home slot
+// for a session is the top bits of the session id multiplied by the
+// golden ratio constant 0x9E3779B97F4A7C15 and the entry can be in any
+// of the probes slots starting there and wrapping around.  Every entry
+// is protected by a seqlock, so a reader loads the sequence and retries
+// while it is odd, copies the entry, then loads the sequence again and
+// retries if it changed.  The copy is valid if the session matches.
+
+struct ResultHeader
+{
+	u_int32_t	magic;
+	u_int32_t	entries;
+	u_int32_t	probes;
+	u_int32_t	protocount;
+	char		pad[48];
+};
+
+// The application and protochain hold protocol ids which are the index
+// of the protocol name in the table that follows the entries.
+
+struct ResultEntry
+{
+	u_int32_t	sequence;
+	u_int8_t	state;
+	u_int8_t	confidence;
+	u_int16_t	application;
+	u_int64_t	session;
+	u_int16_t	chain_length;
+	u_int16_t	protochain[RESULT_CHAIN];
 };
 /*--------------------------------------------------------------------------*/
 void* classify_thread(void *arg);
+void classify_dispatch(MessageWagon *argWagon);
 void attr_callback(navl_handle_t handle,navl_conn_t conn,int attr_type,int attr_length,const void *attr_value,int attr_flag,void *arg);
 int navl_callback(navl_handle_t handle,navl_result_t result,navl_state_t state,navl_conn_t conn,void *arg,int error);
+int packet_callback(navl_handle_t handle,navl_result_t result,navl_state_t state,navl_conn_t conn,void *arg,int error);
 void vineyard_shutdown(void);
 void vineyard_debug(const char *dumpfile);
-void vineyard_classify(SessionObject *argSession,const void *argBuffer,int argLength);
+void vineyard_classify(PacketResult *argResult,const void *argBuffer,int argLength);
 void navl_bind_externals(void);
 void log_vineyard(SessionObject *session,const char *message,int direction,const void *rawdata,int rawsize);
-int vineyard_startup(void);
+int vineyard_startup(int argWorker);
 int vineyard_config(const char *key,int value);
 int	vineyard_logger(const char *level,const char *func,const char *format,...);
 int vineyard_printf(const char *format,...);
@@ -302,22 +947,48 @@ char *nowtimestr(char *target);
 char *runtimestr(char *target);
 char *pad(char *target,u_int64_t value,int width = 0);
 /*--------------------------------------------------------------------------*/
+// The session ids are mostly sequential so both session tables use the
+// murmur3 finalizer to mix every input bit into every output bit.  The
+// tables are a power of two in size and just mask the bits they need
+// which avoids a 64 bit divide that is very slow on the ARM targets.
+inline u_int64_t session_hash(u_int64_t aValue)
+{
+aValue ^= (aValue >> 33);
+aValue *= 0xFF51AFD7ED558CCDULL;
+aValue ^= (aValue >> 33);
+aValue *= 0xC4CEB9FE1A85EC53ULL;
+aValue ^= (aValue >> 33);
+return(aValue);
+}
+/*--------------------------------------------------------------------------*/
 #ifndef DATALOC
 #define DATALOC extern
 #endif
 /*--------------------------------------------------------------------------*/
 DATALOC protostats			**g_protostats;
-DATALOC pthread_t			g_classify_tid;
+DATALOC pthread_t			*g_classify_tid;
 DATALOC sem_t				g_classify_sem;
 DATALOC struct itimerval	g_itimer;
 DATALOC struct timeval		g_runtime;
+DATALOC time_t				g_clock;
 DATALOC size_t				g_stacksize;
-DATALOC NetworkServer		*g_netserver;
-DATALOC MessageQueue		*g_messagequeue;
-DATALOC HashTable			*g_sessiontable;
+DATALOC NetworkServer		**g_netserver;
+DATALOC MessageQueue		**g_messagequeue;
+DATALOC MemoryPool			*g_wagonpool[3];
+DATALOC MemoryPool			*g_sessionpool;
+DATALOC ObjectTable			*g_sessiontable;
+DATALOC ResultTable			*g_resulttable;
+DATALOC EpochManager		*g_epochmanager;
+DATALOC TimerWheel			*g_timerwheel;
+DATALOC StringTable			*g_stringtable;
 DATALOC FILE				*g_logfile;
 DATALOC char				g_cfgfile[256];
 DATALOC int					g_protocount;
+DATALOC int					g_classify_count;
+DATALOC int					g_netserver_count;
+DATALOC int					g_streamsock;
+DATALOC int					g_packetsock;
+DATALOC int					g_subscriber_count;
 DATALOC int					g_logrecycle;
 DATALOC int					g_shutdown;
 DATALOC int					g_console;
@@ -330,6 +1001,10 @@ DATALOC char				cfg_dump_path[256];
 DATALOC char				cfg_core_path[256];
 DATALOC char				cfg_log_path[256];
 DATALOC char				cfg_log_file[256];
+DATALOC char				cfg_stream_socket[108];
+DATALOC char				cfg_packet_socket[108];
+DATALOC char				cfg_result_table[256];
+DATALOC char				cfg_session_table[16];
 DATALOC int					cfg_facebook_subclass;
 DATALOC int					cfg_skype_confidence_thresh;
 DATALOC int					cfg_skype_packet_thresh;
@@ -340,6 +1015,9 @@ DATALOC int					cfg_skype_seq_cache_time;
 DATALOC int					cfg_packet_timeout;
 DATALOC int					cfg_packet_maximum;
 DATALOC int					cfg_hash_buckets;
+DATALOC int					cfg_classify_threads;
+DATALOC int					cfg_io_threads;
+DATALOC int					cfg_result_entries;
 DATALOC int					cfg_navl_defrag;
 DATALOC int					cfg_navl_debug;
 DATALOC int					cfg_mem_limit;
@@ -368,5 +1046,11 @@ DATALOC int					vineyard_protofail;
 DATALOC int					vineyard_appfail;
 DATALOC int					client_misscount;
 DATALOC int					client_hitcount;
+DATALOC u_int64_t			session_dropcount;
+DATALOC u_int64_t			event_totalcount;
+DATALOC u_int64_t			event_dropcount;
+DATALOC u_int64_t			ring_totalcount;
+DATALOC u_int64_t			ring_errorcount;
+DATALOC u_int64_t			result_dropcount;
 /*--------------------------------------------------------------------------*/
 
@@ -11,29 +11,43 @@
 #define SERVER_to_CLIENT	1
 #define RAW_PACKET			2
 #define INVALID_VALUE		1234567890
+#define CLASSIFY_BATCH		64
 
 /*--------------------------------------------------------------------------*/
-// local variables
-static navl_handle_t l_navl_handle = (navl_handle_t)NULL;
-static int l_navl_logfile = 0;
+static void classify_message(MessageWagon *wagon);
+static void count_error(int error);
+
+// local variables - each classify thread has a private vineyard handle
+static __thread navl_handle_t l_navl_handle = (navl_handle_t)NULL;
+static __thread int l_navl_logfile = 0;
+static __thread int l_navl_worker = 0;
+static __thread int l_proto_owner = 0;
+
+// the protocol list is shared so we track how many threads are using it
+static pthread_mutex_t l_proto_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t l_debug_lock = PTHREAD_MUTEX_INITIALIZER;
+static int l_proto_users = 0;
 
 // vars for the attribute names we track
 static const char *l_name_facebook_app = "facebook.app";
 static const char *l_name_tls_hostname = "tls.hostname";
 
 // vars to hold the detail attributes we track
-int l_attr_facebook_app = INVALID_VALUE;
-int l_attr_tls_hostname = INVALID_VALUE;
+static __thread int l_attr_facebook_app = INVALID_VALUE;
+static __thread int l_attr_tls_hostname = INVALID_VALUE;
 /*--------------------------------------------------------------------------*/
 void* classify_thread(void *arg)
 {
-MessageWagon	*wagon;
-SessionObject	*session;
+MessageQueue	*queue;
+MessageWagon	*batch[CLASSIFY_BATCH];
 sigset_t		sigset;
-time_t			current;
-int				ret;
+int				count,ret,x;
 
-sysmessage(LOG_INFO,"The classify thread is starting\n");
+// each thread has a dedicated message queue
+l_navl_worker = (int)(intptr_t)arg;
+queue = g_messagequeue[l_navl_worker];
+
+sysmessage(LOG_INFO,"The classify thread %d is starting\n",l_navl_worker);
 
 // set the itimer value of the main thread which is required
 // for gprof to work properly with multithreaded applications
@@ -50,7 +64,7 @@ sigaddset(&sigset,SIGALRM);
 pthread_sigmask(SIG_UNBLOCK,&sigset,NULL);
 
 // call our vineyard startup function
-ret = vineyard_startup();
+ret = vineyard_startup(l_navl_worker);
 
 // signal the startup complete semaphore
 sem_post(&g_classify_sem);
@@ -62,201 +76,232 @@ sem_post(&g_classify_sem);
 	g_shutdown = 1;
 	}
 
-	// sit in this loop processing messages from the queue
+	// sit in this loop processing batches of messages from the queue
 	while (g_shutdown == 0)
 	{
-	wagon = g_messagequeue->GrabMessage();
-	if (wagon == NULL) continue;
+	count = queue->GrabBatch(batch,CLASSIFY_BATCH);
+
+	// stay in an epoch while we use the sessions we find in the table
+	g_epochmanager->EnterEpoch();
 
-		switch(wagon->command)
+		for(x = 0;x < count;x++)
 		{
-		// used to let us know the daemon is shutting down
-		case MSG_SHUTDOWN:
-			g_shutdown = 1;
-			break;
+		classify_message(batch[x]);
 
-		// only sent from netclient for TCP and UDP sessions to allow navl connection state init
-		case MSG_CREATE:
-			LOGMESSAGE(CAT_SESSION,LOG_DEBUG,"SESSION CREATE %" PRIu64 "\n",wagon->index);
+		// always delete the wagon in which the message arrived
+		delete(batch[x]);
+		}
 
-			// session object should have been created by the netclient thread
-			session = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(wagon->index));
+	g_epochmanager->LeaveEpoch();
+	}
 
-				// missing session means something has gone haywire
-				if (session == NULL)
-				{
-				sysmessage(LOG_WARNING,"MSG_CREATE: Unable to locate %" PRIu64 " in session table\n",wagon->index);
-				break;
-				}
+// call our vineyard shutdown function
+vineyard_shutdown();
 
-			// create the vineyard connection state object
-			ret = navl_conn_create(l_navl_handle,&session->clientinfo,&session->serverinfo,session->GetNetProtocol(),&session->vinestat);
+sysmessage(LOG_INFO,"The classify thread %d has finished\n",l_navl_worker);
+return(NULL);
+}
+/*--------------------------------------------------------------------------*/
+static void classify_message(MessageWagon *wagon)
+{
+SessionObject	*session;
+time_t			current;
+int				ret;
 
-				if (ret != 0)
-				{
-				sysmessage(LOG_ERR,"Error %d returned from navl_conn_create(%" PRIu64 ")\n",navl_error_get(l_navl_handle),wagon->index);
-				g_sessiontable->DeleteObject(session);
-				}
+	switch(wagon->command)
+	{
+	// used to let us know the daemon is shutting down
+	case MSG_SHUTDOWN:
+		g_shutdown = 1;
+		break;
+
+	// only sent from netclient for TCP and UDP sessions to allow navl connection state init
+	case MSG_CREATE:
+		LOGMESSAGE(CAT_SESSION,LOG_DEBUG,"SESSION CREATE %" PRIu64 "\n",wagon->index);
 
-				else
-				{
-				log_vineyard(session,"CREATE",0,NULL,0);
-				}
+		// session object should have been created by the netclient thread
+		session = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(wagon->index));
 
+			// missing session means something has gone haywire
+			if (session == NULL)
+			{
+			sysmessage(LOG_WARNING,"MSG_CREATE: Unable to locate %" PRIu64 " in session table\n",wagon->index);
 			break;
+			}
+
+		// create the vineyard connection state object
+		ret = navl_conn_create(l_navl_handle,&session->clientinfo,&session->serverinfo,session->GetNetProtocol(),&session->vinestat);
 
-		// sent by both netclient and the hashtable stale cleanup function
-		// sent for ALL sessions to allow navl cleanup when required
-		case MSG_REMOVE:
-			LOGMESSAGE(CAT_SESSION,LOG_DEBUG,"SESSION REMOVE %" PRIu64 "\n",wagon->index);
-
-			// find the session object in the hash table
-			session = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(wagon->index));
-
-				// missing session means something has gone haywire
-				if (session == NULL)
-				{
-				sysmessage(LOG_WARNING,"MSG_REMOVE: Unable to locate %" PRIu64 " in session table\n",wagon->index);
-				break;
-				}
-
-				// if the session has a vineyard connection state clean it up
-				if (session->vinestat != NULL)
-				{
-				ret = navl_conn_destroy(l_navl_handle,session->vinestat);
-				if (ret != 0) sysmessage(LOG_ERR,"Error %d returned from navl_conn_destroy(%" PRIu64 ")\n",navl_error_get(l_navl_handle),wagon->index);
-				else log_vineyard(session,"DESTROY",0,NULL,0);
-				}
-
-			// delete the session object from the table
+			if (ret != 0)
+			{
+			sysmessage(LOG_ERR,"Error %d returned from navl_conn_create(%" PRIu64 ")\n",navl_error_get(l_navl_handle),wagon->index);
+			if (g_resulttable != NULL) g_resulttable->RemoveResult(wagon->index);
 			g_sessiontable->DeleteObject(session);
+			}
 
-			break;
+			else
+			{
+			log_vineyard(session,"CREATE",0,NULL,0);
+			}
+
+		break;
+
+	// sent by both netclient and the hashtable stale cleanup function
+	// sent for ALL sessions to allow navl cleanup when required
+	case MSG_REMOVE:
+		LOGMESSAGE(CAT_SESSION,LOG_DEBUG,"SESSION REMOVE %" PRIu64 "\n",wagon->index);
 
-		// this is called to classify TCP or UDP data from the client to the server
-		case MSG_CLIENT:
-			LOGMESSAGE(CAT_SESSION,LOG_DEBUG,"SESSION CLIENT %" PRIu64 " %d BYTES\n",wagon->index,wagon->length);
+		// find the session object in the hash table
+		session = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(wagon->index));
 
-			current = time(NULL);
+			// missing session means something has gone haywire
+			if (session == NULL)
+			{
+			sysmessage(LOG_WARNING,"MSG_REMOVE: Unable to locate %" PRIu64 " in session table\n",wagon->index);
+			break;
+			}
+
+			// if the session has a vineyard connection state clean it up
+			if (session->vinestat != NULL)
+			{
+			ret = navl_conn_destroy(l_navl_handle,session->vinestat);
+			if (ret != 0) sysmessage(LOG_ERR,"Error %d returned from navl_conn_destroy(%" PRIu64 ")\n",navl_error_get(l_navl_handle),wagon->index);
+			else log_vineyard(session,"DESTROY",0,NULL,0);
+			}
 
-				// if data packets are stale we throw them away in hopes of catching up
-				if (current > (wagon->timestamp + cfg_packet_timeout))
-				{
-				msg_timedrop++;
-				break;
-				}
+		// The session object isn't freed until no other thread can be using
+		// it, so remove the published result now in case the same session id
+		// is created again before then.
+		if (g_resulttable != NULL) g_resulttable->RemoveResult(wagon->index);
 
-			// find the session object in the hash table
-			session = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(wagon->index));
+		// delete the session object from the table
+		g_sessiontable->DeleteObject(session);
 
-				// missing session means something has gone haywire
-				if (session == NULL)
-				{
-				sysmessage(LOG_WARNING,"MSG_CLIENT: Unable to locate %" PRIu64 " in session table\n",wagon->index);
-				break;
-				}
+		break;
 
-			log_vineyard(session,"PRE_c2s",CLIENT_to_SERVER,wagon->buffer,wagon->length);
+	// this is called to classify TCP or UDP data from the client to the server
+	case MSG_CLIENT:
+		LOGMESSAGE(CAT_SESSION,LOG_DEBUG,"SESSION CLIENT %" PRIu64 " %d BYTES\n",wagon->index,wagon->length);
 
-			// send the traffic to vineyard for classification
-			ret = navl_classify(l_navl_handle,NAVL_ENCAP_NONE,wagon->buffer,wagon->length,session->vinestat,CLIENT_to_SERVER,navl_callback,session);
-			if (ret != 0) sysmessage(LOG_ERR,"Error %d returned from navl_classify(CLIENT:%" PRIu64 ")\n",navl_error_get(l_navl_handle),wagon->index);
-			else log_vineyard(session,"POST_c2s",CLIENT_to_SERVER,wagon->buffer,wagon->length);
+		current = g_clock;
 
+			// if data packets are stale we throw them away in hopes of catching up
+			if (current > (wagon->timestamp + cfg_packet_timeout))
+			{
+			msg_timedrop++;
 			break;
+			}
 
-		// this is called to classify TCP or UDP data from the server to the client
-		case MSG_SERVER:
-			LOGMESSAGE(CAT_SESSION,LOG_DEBUG,"SESSION SERVER %" PRIu64 " %d BYTES\n",wagon->index,wagon->length);
+		// find the session object in the hash table
+		session = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(wagon->index));
 
-			current = time(NULL);
+			// missing session means something has gone haywire
+			if (session == NULL)
+			{
+			sysmessage(LOG_WARNING,"MSG_CLIENT: Unable to locate %" PRIu64 " in session table\n",wagon->index);
+			break;
+			}
 
-				// if data packets are stale we throw them away in hopes of catching up
-				if (current > (wagon->timestamp + cfg_packet_timeout))
-				{
-				msg_timedrop++;
-				break;
-				}
+		log_vineyard(session,"PRE_c2s",CLIENT_to_SERVER,wagon->buffer,wagon->length);
 
-			// find the session object in the hash table
-			session = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(wagon->index));
+		// send the traffic to vineyard for classification
+		ret = navl_classify(l_navl_handle,NAVL_ENCAP_NONE,wagon->buffer,wagon->length,session->vinestat,CLIENT_to_SERVER,navl_callback,session);
+		if (ret != 0) sysmessage(LOG_ERR,"Error %d returned from navl_classify(CLIENT:%" PRIu64 ")\n",navl_error_get(l_navl_handle),wagon->index);
+		else log_vineyard(session,"POST_c2s",CLIENT_to_SERVER,wagon->buffer,wagon->length);
 
-				// missing session means something has gone haywire
-				if (session == NULL)
-				{
-				sysmessage(LOG_WARNING,"MSG_SERVER: Unable to locate %" PRIu64 " in session table\n",wagon->index);
-				break;
-				}
+		break;
 
-			log_vineyard(session,"PRE_s2c",SERVER_to_CLIENT,wagon->buffer,wagon->length);
+	// this is called to classify TCP or UDP data from the server to the client
+	case MSG_SERVER:
+		LOGMESSAGE(CAT_SESSION,LOG_DEBUG,"SESSION SERVER %" PRIu64 " %d BYTES\n",wagon->index,wagon->length);
 
-			// send the traffic to vineyard for classification
-			ret = navl_classify(l_navl_handle,NAVL_ENCAP_NONE,wagon->buffer,wagon->length,session->vinestat,SERVER_to_CLIENT,navl_callback,session);
-			if (ret != 0) sysmessage(LOG_ERR,"Error %d returned from navl_classify(SERVER:%" PRIu64 ")\n",navl_error_get(l_navl_handle),wagon->index);
-			else log_vineyard(session,"POST_s2c",SERVER_to_CLIENT,wagon->buffer,wagon->length);
+		current = g_clock;
 
+			// if data packets are stale we throw them away in hopes of catching up
+			if (current > (wagon->timestamp + cfg_packet_timeout))
+			{
+			msg_timedrop++;
 			break;
+			}
 
-		// this is called to classify raw IPv4 or IPv6 data
-		case MSG_PACKET:
-			LOGMESSAGE(CAT_SESSION,LOG_DEBUG,"SESSION PACKET %" PRIu64 " %d BYTES\n",wagon->index,wagon->length);
+		// find the session object in the hash table
+		session = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(wagon->index));
 
-			current = time(NULL);
+			// missing session means something has gone haywire
+			if (session == NULL)
+			{
+			sysmessage(LOG_WARNING,"MSG_SERVER: Unable to locate %" PRIu64 " in session table\n",wagon->index);
+			break;
+			}
 
-				// if data packets are stale we throw them away in hopes of catching up
-				if (current > (wagon->timestamp + cfg_packet_timeout))
-				{
-				msg_timedrop++;
-				break;
-				}
+		log_vineyard(session,"PRE_s2c",SERVER_to_CLIENT,wagon->buffer,wagon->length);
 
-			// find the session object in the hash table
-			session = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(wagon->index));
+		// send the traffic to vineyard for classification
+		ret = navl_classify(l_navl_handle,NAVL_ENCAP_NONE,wagon->buffer,wagon->length,session->vinestat,SERVER_to_CLIENT,navl_callback,session);
+		if (ret != 0) sysmessage(LOG_ERR,"Error %d returned from navl_classify(SERVER:%" PRIu64 ")\n",navl_error_get(l_navl_handle),wagon->index);
+		else log_vineyard(session,"POST_s2c",SERVER_to_CLIENT,wagon->buffer,wagon->length);
 
-				// missing session means something has gone haywire
-				if (session == NULL)
-				{
-				sysmessage(LOG_WARNING,"MSG_PACKET: Unable to locate %" PRIu64 " in session table\n",wagon->index);
-				break;
-				}
+		break;
 
-			log_vineyard(session,"PRE_pkt",RAW_PACKET,wagon->buffer,wagon->length);
-			ret = 9999;
+	// this is called to classify raw IPv4 or IPv6 data
+	case MSG_PACKET:
+		LOGMESSAGE(CAT_SESSION,LOG_DEBUG,"SESSION PACKET %" PRIu64 " %d BYTES\n",wagon->index,wagon->length);
 
-				// send IPv6 traffic to vineyard for classification
-				if (session->GetNetProtocol() == IPPROTO_IPV6)
-				{
-				ret = navl_classify(l_navl_handle,NAVL_ENCAP_IP6,wagon->buffer,wagon->length,NULL,0,navl_callback,session);
-				}
+		current = g_clock;
 
-				// send IPv4 traffic to vineyard for classification
-				if (session->GetNetProtocol() == IPPROTO_IP)
-				{
-				ret = navl_classify(l_navl_handle,NAVL_ENCAP_IP,wagon->buffer,wagon->length,NULL,0,navl_callback,session);
-				}
+			// if data packets are stale we throw them away in hopes of catching up
+			if (current > (wagon->timestamp + cfg_packet_timeout))
+			{
+			msg_timedrop++;
+			break;
+			}
 
-			if (ret != 0) sysmessage(LOG_ERR,"Error %d returned from navl_classify(PACKET:%" PRIu64 ")\n",navl_error_get(l_navl_handle),wagon->index);
-			else log_vineyard(session,"POST_pkt",RAW_PACKET,wagon->buffer,wagon->length);
+		// find the session object in the hash table
+		session = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(wagon->index));
 
+			// missing session means something has gone haywire
+			if (session == NULL)
+			{
+			sysmessage(LOG_WARNING,"MSG_PACKET: Unable to locate %" PRIu64 " in session table\n",wagon->index);
 			break;
+			}
 
-		case MSG_DEBUG:
-			vineyard_debug((char *)wagon->buffer);
-			break;
+		log_vineyard(session,"PRE_pkt",RAW_PACKET,wagon->buffer,wagon->length);
+		ret = 9999;
 
-		default:
-			sysmessage(LOG_WARNING,"Unknown thread message received = %c\n",wagon->command);
-		}
+			// send IPv6 traffic to vineyard for classification
+			if (session->GetNetProtocol() == IPPROTO_IPV6)
+			{
+			ret = navl_classify(l_navl_handle,NAVL_ENCAP_IP6,wagon->buffer,wagon->length,NULL,0,navl_callback,session);
+			}
 
-	// always delete the wagon in which the message arrived
-	delete(wagon);
-	}
+			// send IPv4 traffic to vineyard for classification
+			if (session->GetNetProtocol() == IPPROTO_IP)
+			{
+			ret = navl_classify(l_navl_handle,NAVL_ENCAP_IP,wagon->buffer,wagon->length,NULL,0,navl_callback,session);
+			}
 
-// call our vineyard shutdown function
-vineyard_shutdown();
+		if (ret != 0) sysmessage(LOG_ERR,"Error %d returned from navl_classify(PACKET:%" PRIu64 ")\n",navl_error_get(l_navl_handle),wagon->index);
+		else log_vineyard(session,"POST_pkt",RAW_PACKET,wagon->buffer,wagon->length);
 
-sysmessage(LOG_INFO,"The classify thread has finished\n");
-return(NULL);
+		break;
+
+	case MSG_DEBUG:
+		vineyard_debug((char *)wagon->buffer);
+		break;
+
+	default:
+		sysmessage(LOG_WARNING,"Unknown thread message received = %c\n",wagon->command);
+	}
+}
+/*--------------------------------------------------------------------------*/
+void classify_dispatch(MessageWagon *argWagon)
+{
+// Every session is owned by exactly one classify thread since the vineyard
+// connection state can only be used with the handle that created it, so we
+// route each message based on the session id which also guarantees that
+// all messages for any given session are processed in order.
+g_messagequeue[argWagon->index % g_classify_count]->PushMessage(argWagon);
 }
 /*--------------------------------------------------------------------------*/
 int navl_callback(navl_handle_t handle,navl_result_t result,navl_state_t state,navl_conn_t conn,void *arg,int error)
@@ -265,8 +310,12 @@ navl_iterator_t		it;
 SessionObject		*session = (SessionObject *)arg;
 char				namestr[256];
 char				protochain[256];
+u_int16_t			chain[RESULT_CHAIN];
+u_int16_t			chainkey[CHAIN_MAXIMUM];
+u_int16_t			nameid,chainid;
 int					appid,value;
 int					confidence;
+int					chainlen,keylen;
 
 // if the session object passed is null we can't update
 // this should never happen but we check just in case
@@ -277,22 +326,7 @@ log_vineyard(session,"CALLBACK",0,NULL,0);
 	// keep track of errors returned by vineyard
 	if (error != 0)
 	{
-		switch (error)
-		{
-		case ENOMEM:	err_nomem++;	break;
-		case ENOBUFS:	err_nobufs++;	break;
-		case EPROTO:	err_proto++;	break;
-		case ENOTCONN:	err_notconn++;	break;
-		case EBUSY:		err_busy++;		break;
-		case EEXIST:	err_exist++;	break;
-		case EINVAL:	err_inval++;	break;
-		case ECANCELED:	err_canceled++;	break;
-		case ENOENT:	err_noent++;	break;
-		case EPROTONOSUPPORT:	err_protonosupport++; break;
-		case ENOSYS:	err_nosys++;	break;
-		case ECHILD:	err_child++;	break;
-		default:		err_unknown++;	break;
-		}
+	count_error(error);
 
 	// if there was an error return but keep tracking the session
 	return(0);
@@ -303,37 +337,63 @@ confidence = 0;
 appid = navl_app_get(handle,result,&confidence);
 
 	// if the appid is out of bounds return but keep tracking the session
-	if ((appid < 0) || (appid > g_protocount))
+	if ((appid < 0) || (appid >= g_protocount))
 	{
 	vineyard_appfail++;
 	return(0);
 	}
 
-// clear local variables that we fill in while building the protochain
-protochain[0] = 0;
+// clear local variables that we fill in while walking the protochain
+chainlen = 0;
+keylen = 0;
 
-	// build the protochain
+	// Collect the protocol indexes which are the key for finding the
+	// interned protochain so we only build the string the first time we
+	// see each chain.  Out of bounds protocols are saved as the count.
 	for(it = navl_proto_first(handle,result);navl_proto_valid(handle,it);navl_proto_next(handle,it))
 	{
 	// get the protocol index
 	value = navl_proto_get_index(handle,it);
 
-		// if the protocol is out of bounds just use question marks
-		if ((value < 0) || (value > g_protocount))
+		if ((value < 0) || (value >= g_protocount))
 		{
-		strncat(protochain,"/???",sizeof(protochain)-1);
+		if (keylen < CHAIN_MAXIMUM) chainkey[keylen++] = g_protocount;
 		vineyard_protofail++;
 		continue;
 		}
 
-	// append the protocol name to the chain
-	strncat(protochain,"/",sizeof(protochain)-1);
-	strncat(protochain,g_protostats[value]->protocol_name,sizeof(protochain)-1);
-	g_protostats[value]->packet_count++;
+	// save the protocol id for the result table and the chain key
+	if (chainlen < RESULT_CHAIN) chain[chainlen++] = value;
+	if (keylen < CHAIN_MAXIMUM) chainkey[keylen++] = value;
+	__sync_fetch_and_add(&g_protostats[value]->packet_count,1);
+	}
+
+// the application name is interned once and the id saved in the protostats
+nameid = __atomic_load_n(&g_protostats[appid]->string_id,__ATOMIC_RELAXED);
+
+	if (nameid == 0)
+	{
+	nameid = g_stringtable->InsertString(g_protostats[appid]->protocol_name);
+	if (nameid != STRING_OVERFLOW) __atomic_store_n(&g_protostats[appid]->string_id,nameid,__ATOMIC_RELAXED);
 	}
 
-// update the session object with the new information
-session->UpdateObject(g_protostats[appid]->protocol_name,protochain,confidence,state);
+chainid = g_stringtable->InsertChain(chainkey,keylen,protochain,sizeof(protochain));
+
+	// update the session object with the interned names unless the string
+	// table is full in which case the session has to keep its own copies
+	if ((nameid == STRING_OVERFLOW) || (chainid == STRING_OVERFLOW))
+	{
+	if (chainid != STRING_OVERFLOW) strcpy(protochain,g_stringtable->GetString(chainid));
+	session->UpdateObject(g_protostats[appid]->protocol_name,protochain,confidence,state);
+	}
+
+	else
+	{
+	session->UpdateObject(nameid,chainid,confidence,state);
+	}
+
+// publish the result for readers of the shared result table
+if (g_resulttable != NULL) g_resulttable->UpdateResult(session->GetNetSession(),appid,chain,chainlen,confidence,state);
 
 LOGMESSAGE(CAT_UPDATE,LOG_DEBUG,"CLASSIFY UPDATE (V:%" PRIXPTR ") %s\n",conn,session->GetObjectString(namestr,sizeof(namestr)));
 
@@ -341,6 +401,83 @@ LOGMESSAGE(CAT_UPDATE,LOG_DEBUG,"CLASSIFY UPDATE (V:%" PRIXPTR ") %s\n",conn,ses
 return(0);
 }
 /*--------------------------------------------------------------------------*/
+int packet_callback(navl_handle_t handle,navl_result_t result,navl_state_t state,navl_conn_t,void *arg,int error)
+{
+navl_iterator_t		it;
+PacketResult		*packet = (PacketResult *)arg;
+int					appid,value;
+int					confidence;
+
+// if the packet result passed is null we can't update
+// this should never happen but we check just in case
+if (packet == NULL) return(0);
+
+	// keep track of errors returned by vineyard
+	if (error != 0)
+	{
+	count_error(error);
+	return(0);
+	}
+
+// get the application id and confidence
+confidence = 0;
+appid = navl_app_get(handle,result,&confidence);
+
+	// if the appid is out of bounds return without changing the result
+	if ((appid < 0) || (appid >= g_protocount))
+	{
+	vineyard_appfail++;
+	return(0);
+	}
+
+packet->application = appid;
+packet->confidence = confidence;
+packet->state = state;
+packet->chain_length = 0;
+
+	// Save the protocol indexes and leave the names for the reply so
+	// quiet clients never pay for building the protochain string.  Out
+	// of bounds protocols are saved as the protocol count.
+	for(it = navl_proto_first(handle,result);navl_proto_valid(handle,it);navl_proto_next(handle,it))
+	{
+	value = navl_proto_get_index(handle,it);
+
+		if ((value < 0) || (value >= g_protocount))
+		{
+		value = g_protocount;
+		vineyard_protofail++;
+		}
+
+		else __sync_fetch_and_add(&g_protostats[value]->packet_count,1);
+
+	if (packet->chain_length < RESULT_CHAIN) packet->protochain[packet->chain_length++] = value;
+	}
+
+LOGMESSAGE(CAT_UPDATE,LOG_DEBUG,"CLASSIFY PACKET %" PRIu64 " [%d|%d|%d|%d]\n",packet->session,packet->state,packet->confidence,appid,packet->chain_length);
+
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+static void count_error(int error)
+{
+	switch (error)
+	{
+	case ENOMEM:	err_nomem++;	break;
+	case ENOBUFS:	err_nobufs++;	break;
+	case EPROTO:	err_proto++;	break;
+	case ENOTCONN:	err_notconn++;	break;
+	case EBUSY:		err_busy++;		break;
+	case EEXIST:	err_exist++;	break;
+	case EINVAL:	err_inval++;	break;
+	case ECANCELED:	err_canceled++;	break;
+	case ENOENT:	err_noent++;	break;
+	case EPROTONOSUPPORT:	err_protonosupport++; break;
+	case ENOSYS:	err_nosys++;	break;
+	case ECHILD:	err_child++;	break;
+	default:		err_unknown++;	break;
+	}
+}
+/*--------------------------------------------------------------------------*/
 void attr_callback(navl_handle_t handle,navl_conn_t conn,int attr_type,int attr_length,const void *attr_value,int attr_flag,void *arg)
 {
 SessionObject		*session = (SessionObject *)arg;
@@ -377,13 +514,20 @@ if (l_attr_tls_hostname == INVALID_VALUE) l_attr_tls_hostname = navl_attr_key_ge
 	return;
 	}
 
+	// under MFW the argument is the packet result for the client
+	if (g_mfwflag != 0)
+	{
+	strcpy(((PacketResult *)arg)->detail,detail);
+	return;
+	}
+
 // update the session object with the data received
 session->UpdateDetail(detail);
 
 LOGMESSAGE(CAT_UPDATE,LOG_DEBUG,"CLASSIFY DETAIL %s\n",session->GetObjectString(namestr,sizeof(namestr)));
 }
 /*--------------------------------------------------------------------------*/
-int vineyard_startup(void)
+int vineyard_startup(int argWorker)
 {
 const char	*check;
 char		work[32];
@@ -391,6 +535,9 @@ int			problem = 0;
 int			junk,ret;
 int			l,x,y;
 
+// save the worker index for logging and debug output
+l_navl_worker = argWorker;
+
 // bind the vineyard external references
 navl_bind_externals();
 
@@ -464,6 +611,16 @@ ret = navl_proto_max_index(l_navl_handle);
 	return(160);
 	}
 
+// the protocol list is shared by all threads so only the first one builds it
+pthread_mutex_lock(&l_proto_lock);
+l_proto_owner = 1;
+
+	if (l_proto_users++ != 0)
+	{
+	pthread_mutex_unlock(&l_proto_lock);
+	return(0);
+	}
+
 // create the array of protocol statistics
 g_protocount = (ret + 1);
 g_protostats = (protostats **)malloc(g_protocount * sizeof(protostats *));
@@ -497,8 +654,11 @@ g_protostats = (protostats **)malloc(g_protocount * sizeof(protostats *));
         g_protostats[x] = (protostats *)malloc(sizeof(protostats));
         strcpy(g_protostats[x]->protocol_name,work);
         g_protostats[x]->packet_count = 0;
+        g_protostats[x]->string_id = 0;
         }
 
+pthread_mutex_unlock(&l_proto_lock);
+
 return(0);
 }
 /*--------------------------------------------------------------------------*/
@@ -512,30 +672,43 @@ navl_fini(l_navl_handle);
 // shut down the vineyard engine
 navl_close(l_navl_handle);
 
-// free the protostats
-for(x = 0;x < g_protocount;x++) free(g_protostats[x]);
-free(g_protostats);
+// if we never got as far as the protocol list we're done
+if (l_proto_owner == 0) return;
+l_proto_owner = 0;
+
+pthread_mutex_lock(&l_proto_lock);
+
+	// the last thread out frees the protostats
+	if (--l_proto_users == 0)
+	{
+	for(x = 0;x < g_protocount;x++) free(g_protostats[x]);
+	free(g_protostats);
+	g_protostats = NULL;
+	g_protocount = 0;
+	}
+
+pthread_mutex_unlock(&l_proto_lock);
 }
 /*--------------------------------------------------------------------------*/
-void vineyard_classify(SessionObject *argSession,const void *argBuffer,int argLength)
+void vineyard_classify(PacketResult *argResult,const void *argBuffer,int argLength)
 {
 int					ret;
 
 ret = 9999;
 
 	// send IPv6 traffic to vineyard for classification
-	if (argSession->GetNetProtocol() == IPPROTO_IPV6)
+	if (argResult->protocol == IPPROTO_IPV6)
 	{
-	ret = navl_classify(l_navl_handle,NAVL_ENCAP_IP6,argBuffer,argLength,NULL,0,navl_callback,argSession);
+	ret = navl_classify(l_navl_handle,NAVL_ENCAP_IP6,argBuffer,argLength,NULL,0,packet_callback,argResult);
 	}
 
 	// send IPv4 traffic to vineyard for classification
-	if (argSession->GetNetProtocol() == IPPROTO_IP)
+	if (argResult->protocol == IPPROTO_IP)
 	{
-	ret = navl_classify(l_navl_handle,NAVL_ENCAP_IP,argBuffer,argLength,NULL,0,navl_callback,argSession);
+	ret = navl_classify(l_navl_handle,NAVL_ENCAP_IP,argBuffer,argLength,NULL,0,packet_callback,argResult);
 	}
 
-if (ret != 0) sysmessage(LOG_ERR,"Error %d returned from navl_classify(PACKET:%" PRIu64 ")\n",navl_error_get(l_navl_handle),argSession->GetNetSession());
+if (ret != 0) sysmessage(LOG_ERR,"Error %d returned from navl_classify(PACKET:%" PRIu64 ")\n",navl_error_get(l_navl_handle),argResult->session);
 }
 /*--------------------------------------------------------------------------*/
 int vineyard_config(const char *key,int value)
@@ -553,15 +726,25 @@ void vineyard_debug(const char *dumpfile)
 {
 FILE		*stream;
 
+// multiple classify threads share the dump file so we take turns
+pthread_mutex_lock(&l_debug_lock);
+
 // open the dumpfile for append
 stream = fopen(dumpfile,"a");
 
+	if (stream == NULL)
+	{
+	pthread_mutex_unlock(&l_debug_lock);
+	return;
+	}
+
 // set file descriptor to capture output from vineyard
 l_navl_logfile = fileno(stream);
 
 // dump the vineyard diagnostic info and include calls
 // to fflush since we're passing the file descriptor
 
+fprintf(stream,"========== VINEYARD THREAD %d ==========\r\n",l_navl_worker);
 fprintf(stream,"========== VINEYARD SYSTEM INFO ==========\r\n");
 fflush(stream);
 navl_diag(l_navl_handle,"SYSTEM","1");
@@ -587,6 +770,8 @@ l_navl_logfile = 0;
 
 fprintf(stream,"\r\n");
 fclose(stream);
+
+pthread_mutex_unlock(&l_debug_lock);
 }
 /*--------------------------------------------------------------------------*/
 int	vineyard_logger(const char *level,const char *func,const char *format,...)
@@ -9,6 +9,7 @@
 #include <semaphore.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
@@ -16,20 +17,32 @@
 #include <signal.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <poll.h>
 #include <math.h>
+#include <new>
 #include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <linux/netfilter.h>
+#include <linux/futex.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "vineyard/api/navl.h"
@@ -0,0 +1,239 @@
+// EPOCH.CPP
+// Traffic Classification Engine
+// Copyright (c) 2011-2018 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+#include "classd.h"
+/*--------------------------------------------------------------------------*/
+EpochManager::EpochManager(void)
+{
+int		x;
+
+// the epoch starts at one since zero marks a slot that isn't reading
+globalepoch = 1;
+retirelist = NULL;
+retirecount = 0;
+freedcount = 0;
+
+	for(x = 0;x < EPOCH_SLOTS;x++)
+	{
+	slots[x].active = 0;
+	slots[x].depth = 0;
+	slots[x].owner = 0;
+	}
+
+// initialize the retire lock and the key for the per-thread slots
+pthread_mutex_init(&retirelock,NULL);
+pthread_key_create(&slotkey,FreeSlot);
+}
+/*--------------------------------------------------------------------------*/
+EpochManager::~EpochManager(void)
+{
+RetireItem	*item;
+
+pthread_key_delete(slotkey);
+
+	// nothing is reading at shutdown so free everything still waiting
+	while (retirelist != NULL)
+	{
+	item = retirelist;
+	retirelist = item->next;
+	ReleaseItem(item);
+	}
+
+pthread_mutex_destroy(&retirelock);
+}
+/*--------------------------------------------------------------------------*/
+EpochManager::EpochSlot* EpochManager::GetSlot(void)
+{
+EpochSlot	*slot;
+int			x;
+
+// most of the time the calling thread already has a slot
+slot = (EpochSlot *)pthread_getspecific(slotkey);
+if (slot != NULL) return(slot);
+
+	// first time this thread has entered an epoch so claim a free slot
+	for(x = 0;x < EPOCH_SLOTS;x++)
+	{
+	if (__sync_bool_compare_and_swap(&slots[x].owner,0,1) == 0) continue;
+	pthread_setspecific(slotkey,&slots[x]);
+	return(&slots[x]);
+	}
+
+// The only threads that read the tables are the classify and netserver
+// threads which are limited to 32 each and the main thread, so running
+// out of slots means they are leaking and we can't safely continue.
+sysmessage(LOG_ERR,"All %d epoch slots are in use\n",EPOCH_SLOTS);
+abort();
+}
+/*--------------------------------------------------------------------------*/
+void EpochManager::FreeSlot(void *aSlot)
+{
+EpochSlot	*slot = (EpochSlot *)aSlot;
+
+// called when a thread exits to give the slot back
+slot->depth = 0;
+__atomic_store_n(&slot->active,0,__ATOMIC_RELEASE);
+__atomic_store_n(&slot->owner,0,__ATOMIC_RELEASE);
+}
+/*--------------------------------------------------------------------------*/
+void EpochManager::EnterEpoch(void)
+{
+EpochSlot	*slot;
+
+slot = GetSlot();
+
+// calls can be nested and only the outermost one does anything
+if (slot->depth++ != 0) return;
+
+// Publish the epoch we are reading in before we look at anything shared.
+// The full fence makes sure the reclaim scan either sees our slot or we
+// see the table after every object it is about to free was removed.
+__atomic_store_n(&slot->active,__atomic_load_n(&globalepoch,__ATOMIC_RELAXED),__ATOMIC_RELAXED);
+__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+/*--------------------------------------------------------------------------*/
+void EpochManager::LeaveEpoch(void)
+{
+EpochSlot	*slot;
+
+slot = GetSlot();
+if (--slot->depth != 0) return;
+
+__atomic_store_n(&slot->active,0,__ATOMIC_RELEASE);
+}
+/*--------------------------------------------------------------------------*/
+void EpochManager::RetireObject(HashObject *aObject)
+{
+RetireItem	*item;
+
+item = (RetireItem *)malloc(sizeof(RetireItem));
+
+	// a reader may still be using the object so without an item
+	// to track it the only safe thing we can do is leak it
+	if (item == NULL)
+	{
+	sysmessage(LOG_ERR,"Unable to allocate memory to retire an object\n");
+	return;
+	}
+
+item->object = aObject;
+item->memory = NULL;
+InsertItem(item);
+}
+/*--------------------------------------------------------------------------*/
+void EpochManager::RetireMemory(void *aMemory)
+{
+RetireItem	*item;
+
+if (aMemory == NULL) return;
+
+item = (RetireItem *)malloc(sizeof(RetireItem));
+
+	// same as above we have to leak the memory if we can't track it
+	if (item == NULL)
+	{
+	sysmessage(LOG_ERR,"Unable to allocate memory to retire a block\n");
+	return;
+	}
+
+item->object = NULL;
+item->memory = aMemory;
+InsertItem(item);
+}
+/*--------------------------------------------------------------------------*/
+void EpochManager::InsertItem(RetireItem *aItem)
+{
+int		count;
+
+// The caller has already removed the item from the table so any reader
+// that can still find it must have entered at or before this epoch.
+aItem->epoch = __atomic_load_n(&globalepoch,__ATOMIC_SEQ_CST);
+
+pthread_mutex_lock(&retirelock);
+aItem->next = retirelist;
+retirelist = aItem;
+count = ++retirecount;
+pthread_mutex_unlock(&retirelock);
+
+// don't let the list grow too long between the periodic reclaims
+// but only try once per batch in case readers are holding it up
+if ((count % EPOCH_BATCH) == 0) ReclaimObjects();
+}
+/*--------------------------------------------------------------------------*/
+int EpochManager::ReclaimObjects(void)
+{
+RetireItem	*item,*next,*keep,*drop;
+u_int64_t	current,oldest,active;
+int			count,x;
+
+// advance the epoch so readers that enter from now on can be told
+// apart from the ones that might still hold something we retired
+current = __atomic_add_fetch(&globalepoch,1,__ATOMIC_SEQ_CST);
+oldest = current;
+
+	// find the oldest epoch still being read by any thread
+	for(x = 0;x < EPOCH_SLOTS;x++)
+	{
+	active = __atomic_load_n(&slots[x].active,__ATOMIC_ACQUIRE);
+	if ((active != 0) && (active < oldest)) oldest = active;
+	}
+
+keep = drop = NULL;
+count = 0;
+
+pthread_mutex_lock(&retirelock);
+
+	// anything retired before the oldest reader entered can be freed
+	for(item = retirelist;item != NULL;item = next)
+	{
+	next = item->next;
+
+		if (item->epoch < oldest)
+		{
+		item->next = drop;
+		drop = item;
+		count++;
+		}
+
+		else
+		{
+		item->next = keep;
+		keep = item;
+		}
+	}
+
+retirelist = keep;
+retirecount-=count;
+
+pthread_mutex_unlock(&retirelock);
+
+	// free everything outside the lock since the object destructors
+	// can take a while and other threads may be retiring more
+	for(item = drop;item != NULL;item = next)
+	{
+	next = item->next;
+	ReleaseItem(item);
+	}
+
+if (count != 0) __sync_fetch_and_add(&freedcount,count);
+return(count);
+}
+/*--------------------------------------------------------------------------*/
+void EpochManager::ReleaseItem(RetireItem *aItem)
+{
+if (aItem->object != NULL) delete(aItem->object);
+if (aItem->memory != NULL) free(aItem->memory);
+free(aItem);
+}
+/*--------------------------------------------------------------------------*/
+void EpochManager::GetEpochStats(u_int64_t &aEpoch,int &aPending,u_int64_t &aFreed)
+{
+aEpoch = __atomic_load_n(&globalepoch,__ATOMIC_RELAXED);
+aPending = __atomic_load_n(&retirecount,__ATOMIC_RELAXED);
+aFreed = __atomic_load_n(&freedcount,__ATOMIC_RELAXED);
+}
+/*--------------------------------------------------------------------------*/
@@ -0,0 +1,449 @@
+// FLATTABLE.CPP
+// Traffic Classification Engine
+// Copyright (c) 2011-2018 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+#include "classd.h"
+
+// Values for the control bytes that are not the hash of a full slot.
+// Both have the high bit set so they never match a seven bit hash.
+static const u_int8_t FLAT_EMPTY = 0x80;
+static const u_int8_t FLAT_DELETED = 0xFE;
+
+// The number of times a search will retry without locking when a resize
+// keeps replacing the arrays before it gives up and locks the shard.
+static const int FLAT_RETRY = 4;
+/*--------------------------------------------------------------------------*/
+FlatTable::FlatTable(int aBuckets)
+{
+unsigned	groups,want;
+int			x;
+
+// figure out how many groups each shard needs to hold its share of
+// the buckets below the maximum load and round up to a power of two
+want = ((aBuckets / FLAT_SHARDS) * 8 / 7 / FLAT_GROUP);
+for(groups = 1;groups < want;groups<<=1);
+
+shards = new FlatShard[FLAT_SHARDS];
+
+	for(x = 0;x < FLAT_SHARDS;x++)
+	{
+	pthread_mutex_init(&shards[x].lock,NULL);
+	shards[x].control = NULL;
+	shards[x].slots = NULL;
+	shards[x].groups = 0;
+	shards[x].count = 0;
+	shards[x].deleted = 0;
+	shards[x].version = 0;
+	ResizeShard(&shards[x],groups);
+	}
+}
+/*--------------------------------------------------------------------------*/
+FlatTable::~FlatTable(void)
+{
+FlatShard	*shard;
+unsigned	y;
+int			x;
+
+	// walk through all the shards and delete everything
+	for(x = 0;x < FLAT_SHARDS;x++)
+	{
+	shard = &shards[x];
+
+		for(y = 0;y < (shard->groups * FLAT_GROUP);y++)
+		{
+		if (shard->control[y] & 0x80) continue;
+		delete(shard->slots[y].object);
+		}
+
+	free(shard->control);
+	free(shard->slots);
+	pthread_mutex_destroy(&shard->lock);
+	}
+
+delete[] shards;
+}
+/*--------------------------------------------------------------------------*/
+int FlatTable::InsertObject(HashObject *aObject)
+{
+FlatShard	*shard;
+FlatSlot	*slots;
+u_int8_t	*control;
+u_int64_t	hash;
+unsigned	capacity;
+
+hash = GetHashValue(aObject->netsession);
+shard = &shards[hash >> 58];
+control = NULL;
+slots = NULL;
+
+pthread_mutex_lock(&shard->lock);
+
+capacity = (shard->groups * FLAT_GROUP);
+
+	// keep the load including deleted slots under seven eighths by
+	// doubling when the shard is really getting full or rebuilding it
+	// at the same size to clear out the deleted slots if it isn't
+	if (((shard->count + shard->deleted + 1) * 8) > (capacity * 7))
+	{
+	control = shard->control;
+	slots = shard->slots;
+	if (((shard->count + 1) * 16) > (capacity * 7)) ResizeShard(shard,shard->groups * 2);
+	else ResizeShard(shard,shard->groups);
+	}
+
+InsertSlot(shard,hash,aObject->netsession,aObject);
+
+pthread_mutex_unlock(&shard->lock);
+
+// searches may still be looking at the old arrays if we resized so they
+// are retired after the unlock since retiring can reclaim other objects
+g_epochmanager->RetireMemory(control);
+g_epochmanager->RetireMemory(slots);
+
+return(hash >> 58);
+}
+/*--------------------------------------------------------------------------*/
+int FlatTable::DeleteObject(HashObject *aObject)
+{
+FlatShard	*shard;
+u_int64_t	hash;
+unsigned	base;
+int			slot;
+
+hash = GetHashValue(aObject->netsession);
+shard = &shards[hash >> 58];
+
+pthread_mutex_lock(&shard->lock);
+
+slot = FindSlot(shard->control,shard->slots,shard->groups,hash,aObject->netsession);
+
+	// if we don't find the object just unlock and return
+	if ((slot < 0) || (shard->slots[slot].object != aObject))
+	{
+	pthread_mutex_unlock(&shard->lock);
+	return(0);
+	}
+
+base = (slot & ~(FLAT_GROUP - 1));
+
+	// A search always stops at a group that has an empty slot so if this
+	// group already has one we can mark the slot empty.  Otherwise other
+	// objects may have probed past this group and we leave a marker.
+	if (MatchGroup(&shard->control[base],FLAT_EMPTY) != 0)
+	{
+	__atomic_store_n(&shard->control[slot],FLAT_EMPTY,__ATOMIC_RELEASE);
+	}
+
+	else
+	{
+	__atomic_store_n(&shard->control[slot],FLAT_DELETED,__ATOMIC_RELEASE);
+	shard->deleted++;
+	}
+
+__atomic_store_n(&shard->slots[slot].session,0,__ATOMIC_RELAXED);
+__atomic_store_n(&shard->slots[slot].object,(HashObject *)NULL,__ATOMIC_RELAXED);
+shard->count--;
+
+pthread_mutex_unlock(&shard->lock);
+
+// a search may have found the item before we pulled it out of the
+// table so it is retired instead of deleted, and we do it after the
+// unlock since retiring can run the destructors of other objects
+g_epochmanager->RetireObject(aObject);
+
+// return one item deleted
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+HashObject* FlatTable::SearchObject(u_int64_t aValue)
+{
+FlatShard	*shard;
+HashObject	*find;
+FlatSlot	*slots;
+u_int8_t	*control;
+u_int64_t	hash;
+u_int32_t	before,after;
+unsigned	groups;
+int			slot,x;
+
+hash = GetHashValue(aValue);
+shard = &shards[hash >> 58];
+
+	// The caller must be in an epoch so neither the objects we find nor
+	// the arrays replaced by a resize can be freed until it leaves.  The
+	// version is odd during a resize and changes when the arrays do.
+	for(x = 0;x < FLAT_RETRY;x++)
+	{
+	before = __atomic_load_n(&shard->version,__ATOMIC_ACQUIRE);
+	if (before & 1) continue;
+
+	control = __atomic_load_n(&shard->control,__ATOMIC_ACQUIRE);
+	slots = __atomic_load_n(&shard->slots,__ATOMIC_ACQUIRE);
+	groups = __atomic_load_n(&shard->groups,__ATOMIC_ACQUIRE);
+
+	// make sure all three came from the same resize
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&shard->version,__ATOMIC_RELAXED) != before) continue;
+
+	slot = FindSlot(control,slots,groups,hash,aValue);
+
+		// A slot can be reused while we look at it so we only trust the
+		// object pointer if the object itself has the session we want.
+		if (slot >= 0)
+		{
+		find = __atomic_load_n(&slots[slot].object,__ATOMIC_ACQUIRE);
+		if ((find != NULL) && (find->netsession == aValue)) return(find);
+		}
+
+	// a miss only counts if nothing was moved while we were looking
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	after = __atomic_load_n(&shard->version,__ATOMIC_RELAXED);
+	if ((slot < 0) && (after == before)) return(NULL);
+	}
+
+// the shard is busy so search it with the lock held
+pthread_mutex_lock(&shard->lock);
+
+slot = FindSlot(shard->control,shard->slots,shard->groups,hash,aValue);
+find = (slot < 0 ? NULL : shard->slots[slot].object);
+
+pthread_mutex_unlock(&shard->lock);
+
+return(find);
+}
+/*--------------------------------------------------------------------------*/
+u_int64_t FlatTable::GetHashValue(u_int64_t aValue)
+{
+// the mixed value supplies the high bits that select the shard, the low seven
+// bits stored in the control byte, and the middle bits that pick a group
+return(session_hash(aValue));
+}
+/*--------------------------------------------------------------------------*/
+unsigned FlatTable::MatchGroup(const u_int8_t *aGroup,u_int8_t aValue)
+{
+#ifdef __SSE2__
+__m128i		ctrl,want;
+
+ctrl = _mm_loadu_si128((const __m128i *)aGroup);
+want = _mm_set1_epi8((char)aValue);
+return(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl,want)));
+#else
+unsigned	bits;
+int			x;
+
+bits = 0;
+for(x = 0;x < FLAT_GROUP;x++) if (aGroup[x] == aValue) bits |= (1U << x);
+return(bits);
+#endif
+}
+/*--------------------------------------------------------------------------*/
+int FlatTable::FindSlot(const u_int8_t *aControl,const FlatSlot *aSlots,unsigned aGroups,u_int64_t aHash,u_int64_t aValue)
+{
+unsigned	group,base,bits,probe;
+
+group = ((aHash >> 7) & (aGroups - 1));
+
+	// the triangular probe sequence visits every group exactly once
+	// since the number of groups is always a power of two
+	for(probe = 0;probe < aGroups;probe++)
+	{
+	base = (group * FLAT_GROUP);
+	bits = MatchGroup(&aControl[base],(aHash & 0x7F));
+
+		// check the session of every slot with a matching hash byte
+		while (bits != 0)
+		{
+		if (aSlots[base + __builtin_ctz(bits)].session == aValue) return(base + __builtin_ctz(bits));
+		bits&=(bits - 1);
+		}
+
+	// an empty slot means the value was never probed past this group
+	if (MatchGroup(&aControl[base],FLAT_EMPTY) != 0) return(-1);
+
+	group = ((group + probe + 1) & (aGroups - 1));
+	}
+
+return(-1);
+}
+/*--------------------------------------------------------------------------*/
+void FlatTable::InsertSlot(FlatShard *aShard,u_int64_t aHash,u_int64_t aValue,HashObject *aObject)
+{
+unsigned	group,base,bits,probe,slot;
+
+group = ((aHash >> 7) & (aShard->groups - 1));
+
+	// the caller makes sure there is always a free slot
+	for(probe = 0;probe < aShard->groups;probe++)
+	{
+	base = (group * FLAT_GROUP);
+	bits = (MatchGroup(&aShard->control[base],FLAT_EMPTY) | MatchGroup(&aShard->control[base],FLAT_DELETED));
+
+		if (bits != 0)
+		{
+		slot = (base + __builtin_ctz(bits));
+		if (aShard->control[slot] == FLAT_DELETED) aShard->deleted--;
+
+		// fill the slot before the control byte makes it visible to searches
+		__atomic_store_n(&aShard->slots[slot].object,aObject,__ATOMIC_RELAXED);
+		__atomic_store_n(&aShard->slots[slot].session,aValue,__ATOMIC_RELAXED);
+		__atomic_store_n(&aShard->control[slot],(u_int8_t)(aHash & 0x7F),__ATOMIC_RELEASE);
+		aShard->count++;
+		return;
+		}
+
+	group = ((group + probe + 1) & (aShard->groups - 1));
+	}
+}
+/*--------------------------------------------------------------------------*/
+void FlatTable::ResizeShard(FlatShard *aShard,unsigned aGroups)
+{
+u_int8_t	*control;
+FlatSlot	*slots;
+unsigned	groups,x;
+
+// save the old arrays so we can move everything to the new ones but
+// searches may still be looking at them so the caller retires them
+control = aShard->control;
+slots = aShard->slots;
+groups = aShard->groups;
+
+// an odd version tells searches the arrays are being replaced
+__atomic_store_n(&aShard->version,aShard->version + 1,__ATOMIC_RELAXED);
+__atomic_thread_fence(__ATOMIC_RELEASE);
+
+aShard->control = (u_int8_t *)malloc(aGroups * FLAT_GROUP);
+aShard->slots = (FlatSlot *)calloc(aGroups * FLAT_GROUP,sizeof(FlatSlot));
+memset(aShard->control,FLAT_EMPTY,aGroups * FLAT_GROUP);
+aShard->groups = aGroups;
+aShard->count = 0;
+aShard->deleted = 0;
+
+	// move every full slot to the new arrays
+	for(x = 0;x < (groups * FLAT_GROUP);x++)
+	{
+	if (control[x] & 0x80) continue;
+	InsertSlot(aShard,GetHashValue(slots[x].session),slots[x].session,slots[x].object);
+	}
+
+__atomic_store_n(&aShard->version,aShard->version + 1,__ATOMIC_RELEASE);
+}
+/*--------------------------------------------------------------------------*/
+void FlatTable::GetTableSize(int &aCount,int &aBytes)
+{
+FlatShard	*shard;
+unsigned	y;
+int			x;
+
+aCount = 0;
+aBytes = 0;
+
+// start with our size
+aBytes = sizeof(*this);
+aBytes+=(FLAT_SHARDS * sizeof(FlatShard));
+
+	// walk through all of the shards
+	for(x = 0;x < FLAT_SHARDS;x++)
+	{
+	shard = &shards[x];
+
+	// lock the shard
+	pthread_mutex_lock(&shard->lock);
+
+	// add the size of the control and slot arrays
+	aBytes+=(shard->groups * FLAT_GROUP * (1 + sizeof(FlatSlot)));
+
+		// count and add the size of every object in the shard
+		for(y = 0;y < (shard->groups * FLAT_GROUP);y++)
+		{
+		if (shard->control[y] & 0x80) continue;
+		aBytes+=shard->slots[y].object->GetObjectSize();
+		aCount++;
+		}
+
+	// unlock the shard
+	pthread_mutex_unlock(&shard->lock);
+	}
+}
+/*--------------------------------------------------------------------------*/
+void FlatTable::GetLoadStats(int &aBuckets,double &aLoad,int *aHistogram)
+{
+FlatShard	*shard;
+unsigned	group,probe,y;
+int			count,total,x;
+
+memset(aHistogram,0,TABLE_HISTOGRAM * sizeof(int));
+aBuckets = 0;
+total = 0;
+
+	// The histogram counts the number of extra groups we have to probe
+	// to find each object which is the flat table version of a chain.
+	for(x = 0;x < FLAT_SHARDS;x++)
+	{
+	shard = &shards[x];
+
+	pthread_mutex_lock(&shard->lock);
+
+	aBuckets+=(shard->groups * FLAT_GROUP);
+
+		for(y = 0;y < (shard->groups * FLAT_GROUP);y++)
+		{
+		if (shard->control[y] & 0x80) continue;
+		group = ((GetHashValue(shard->slots[y].session) >> 7) & (shard->groups - 1));
+		for(probe = 0;group != (y / FLAT_GROUP);probe++) group = ((group + probe + 1) & (shard->groups - 1));
+		count = (probe >= (unsigned)TABLE_HISTOGRAM ? (TABLE_HISTOGRAM - 1) : probe);
+		aHistogram[count]++;
+		total++;
+		}
+
+	pthread_mutex_unlock(&shard->lock);
+	}
+
+aLoad = ((double)total / (double)aBuckets);
+}
+/*--------------------------------------------------------------------------*/
+void FlatTable::DumpDetail(FILE *aFile)
+{
+FlatShard	*shard;
+char		buffer[256];
+unsigned	y;
+int			count,bytes;
+int			x;
+
+count = 0;
+bytes = 0;
+
+// start with our size
+bytes = sizeof(*this);
+bytes+=(FLAT_SHARDS * sizeof(FlatShard));
+
+	// walk through all of the shards
+	for(x = 0;x < FLAT_SHARDS;x++)
+	{
+	shard = &shards[x];
+
+	// lock the shard
+	pthread_mutex_lock(&shard->lock);
+
+	bytes+=(shard->groups * FLAT_GROUP * (1 + sizeof(FlatSlot)));
+
+		// count and add the size of every object
+		for(y = 0;y < (shard->groups * FLAT_GROUP);y++)
+		{
+		if (shard->control[y] & 0x80) continue;
+		shard->slots[y].object->GetObjectString(buffer,sizeof(buffer));
+		fprintf(aFile,"  %d:%u = %s\n",x,y,buffer);
+		bytes+=shard->slots[y].object->GetObjectSize();
+		count++;
+		}
+
+	// unlock the shard
+	pthread_mutex_unlock(&shard->lock);
+	}
+
+fprintf(aFile,"  TOTAL ITEMS = %d\n",count);
+fprintf(aFile,"  TOTAL BYTES = %d\n",bytes);
+}
+/*--------------------------------------------------------------------------*/
@@ -11,12 +11,10 @@ HashObject::HashObject(u_int64_t aSession,u_int16_t aProtocol)
 {
 netprotocol = aProtocol;
 netsession = aSession;
-timeout = time(NULL);
+timeout = 0;
 next = NULL;
 
 ResetTimeout();
-
-snprintf(netstring,sizeof(netstring),"%" PRIu64,netsession);
 }
 /*--------------------------------------------------------------------------*/
 HashObject::~HashObject(void)
@@ -33,23 +31,30 @@ return(mysize);
 /*--------------------------------------------------------------------------*/
 void HashObject::ResetTimeout(void)
 {
-timeout = time(NULL);
+time_t		value;
+
+// use the coarse clock maintained by the main thread
+value = g_clock;
 
 	switch(netprotocol)
 	{
 	case IPPROTO_TCP:
-		timeout+=cfg_tcp_timeout;
+		value+=cfg_tcp_timeout;
 		break;
 	case IPPROTO_UDP:
-		timeout+=cfg_udp_timeout;
+		value+=cfg_udp_timeout;
 		break;
 	case IPPROTO_IP:
 	case IPPROTO_IPV6:
-		timeout+=cfg_ip_timeout;
+		value+=cfg_ip_timeout;
 		break;
 	default:
-		timeout+=3600;
+		value+=3600;
 	}
+
+// the clock only ticks once a second so most calls would store the same
+// value and we skip the write to keep from dirtying the cache line
+if (timeout != value) timeout = value;
 }
 /*--------------------------------------------------------------------------*/
 
@@ -6,72 +6,105 @@
 
 #include "common.h"
 #include "classd.h"
+
+// The table grows by one bucket when the average chain gets longer than
+// HASH_GROW objects and shrinks by one bucket when it drops below one
+// object for every HASH_SHRINK buckets but never below the initial size.
+static const int HASH_GROW = 1;
+static const int HASH_SHRINK = 4;
+
+// Resizes are skipped by threads that can't get the resize lock so the
+// thread that does get it merges up to this many buckets to catch up.
+static const int HASH_MERGE = 64;
+
+// The number of times a search will retry without locking when a resize
+// keeps moving objects around before it gives up and locks the bucket.
+static const int HASH_RETRY = 4;
 /*--------------------------------------------------------------------------*/
 HashTable::HashTable(int aBuckets)
 {
-int		x;
+unsigned	x;
 
-// save the number of buckets
-buckets = aBuckets;
+// The initial number of buckets is also the minimum and is rounded up to a
+// power of two so the table size is always a power of two at every level.
+basecount = 1;
+while ((basecount < (unsigned)aBuckets) && (basecount < (unsigned)(HASH_SEGMENT * HASH_DIRECTORY / 2))) basecount<<=1;
 
-// allocate the bucket array
-table = (HashObject **)calloc(buckets,sizeof(HashObject *));
+// The state holds the level in the high half and the split pointer in the
+// low half.  The table has basecount << level buckets plus one more for
+// every bucket below the split pointer that has already been split.
+tablestate = 0;
+resizeseq = 0;
+objcount = 0;
 
-// allocate and initialize the bucket locks
-control = (pthread_mutex_t *)calloc(buckets,sizeof(pthread_mutex_t));
+pthread_mutex_init(&resizelock,NULL);
 
-	for(x = 0;x < buckets;x++)
+// allocate the segment directory and the segments for the initial buckets
+directory = (HashSegment **)calloc(HASH_DIRECTORY,sizeof(HashSegment *));
+
+	for(x = 0;x < basecount;x+=HASH_SEGMENT)
 	{
-	memset(&control[0],0,sizeof(pthread_mutex_t));
-	pthread_mutex_init(&control[x],NULL);
+	directory[x / HASH_SEGMENT] = (HashSegment *)calloc(1,sizeof(HashSegment));
 	}
+
+// initialize the bucket locks in every segment we allocated
+for(x = 0;x < basecount;x++) pthread_mutex_init(Control(x),NULL);
+for(;(x % HASH_SEGMENT) != 0;x++) pthread_mutex_init(Control(x),NULL);
 }
 /*--------------------------------------------------------------------------*/
 HashTable::~HashTable(void)
 {
 HashObject	*work,*hold;
-int			x;
+unsigned	x,y;
 
-	// walk through all the buckets and delete everything
-	for(x = 0;x < buckets;x++)
+	// walk through all the segments and delete everything
+	for(x = 0;x < (unsigned)HASH_DIRECTORY;x++)
 	{
-	if (table[x] == NULL) continue;
-	work = table[x];
+	if (directory[x] == NULL) continue;
 
-		while (work != NULL)
+		for(y = 0;y < (unsigned)HASH_SEGMENT;y++)
 		{
-		hold = work->next;
-		delete(work);
-		work = hold;
+		work = directory[x]->table[y];
+
+			while (work != NULL)
+			{
+			hold = work->next;
+			delete(work);
+			work = hold;
+			}
+
+		pthread_mutex_destroy(&directory[x]->control[y]);
 		}
+
+	free(directory[x]);
 	}
 
-// free the bucket array
-free(table);
+// free the segment directory
+free(directory);
 
-// free the bucket locks
-for(x = 0;x < buckets;x++) pthread_mutex_destroy(&control[x]);
-free(control);
+pthread_mutex_destroy(&resizelock);
 }
 /*--------------------------------------------------------------------------*/
 int HashTable::InsertObject(HashObject *aObject)
 {
 unsigned			key;
+int					count;
 
-// calculate bucket using the hash function
-key = GetHashValue(aObject->netsession);
-
-// lock the bucket
-pthread_mutex_lock(&control[key]);
+// lock the bucket where the object belongs
+key = LockBucket(aObject->netsession);
 
 // save existing item in new item next pointer
-aObject->next = table[key];
+aObject->next = Bucket(key);
 
-// put new item at front of list
-table[key] = aObject;
+// put new item at front of list where searches can see it
+__atomic_store_n(&Bucket(key),aObject,__ATOMIC_RELEASE);
 
 // unlock the bucket
-pthread_mutex_unlock(&control[key]);
+pthread_mutex_unlock(Control(key));
+
+// split a bucket if the average chain has grown too long
+count = __sync_add_and_fetch(&objcount,1);
+if ((unsigned)count > (GetBucketCount(__atomic_load_n(&tablestate,__ATOMIC_ACQUIRE)) * HASH_GROW)) SplitBucket();
 
 return(key);
 }
@@ -80,17 +113,15 @@ int HashTable::DeleteObject(HashObject *aObject)
 {
 HashObject	*work,*prev;
 unsigned	key;
+int			count;
 
-// calculate bucket using the hash function
-key = GetHashValue(aObject->netsession);
-
-// lock the bucket
-pthread_mutex_lock(&control[key]);
+// lock the bucket where the object belongs
+key = LockBucket(aObject->netsession);
 
 	// if bucket is empty just unlock and return
-	if (table[key] == NULL)
+	if (Bucket(key) == NULL)
 	{
-	pthread_mutex_unlock(&control[key]);
+	pthread_mutex_unlock(Control(key));
 	return(0);
 	}
 
@@ -98,22 +129,30 @@ pthread_mutex_lock(&control[key]);
 prev = NULL;
 
 	// walk through the bucket and look for a match
-	for(work = table[key];work != NULL;work = work->next)
+	for(work = Bucket(key);work != NULL;work = work->next)
 	{
 		// if we find it pull it out of the chain and delete
 		if (work == aObject)
 		{
 		// if item being deleted is first pull out front of list
-		if (work == table[key]) table[key] = work->next;
+		if (work == Bucket(key)) __atomic_store_n(&Bucket(key),work->next,__ATOMIC_RELEASE);
 
 		// otherwise pull out of the middle of the list
-		else if (prev != NULL) prev->next = work->next;
-
-		// delete the item we pulled out of the linked list
-		delete(work);
+		else if (prev != NULL) __atomic_store_n(&prev->next,work->next,__ATOMIC_RELEASE);
 
 		// unlock the bucket
-		pthread_mutex_unlock(&control[key]);
+		pthread_mutex_unlock(Control(key));
+
+		// The item keeps its next pointer so a search walking the chain
+		// can still get past it, and it is retired instead of deleted
+		// since a search may have found it before we pulled it out.  We
+		// do it after the unlock since retiring can run the destructors
+		// of other objects and we don't want to hold up the bucket.
+		g_epochmanager->RetireObject(work);
+
+		// merge a bucket if the table is mostly empty
+		count = __sync_sub_and_fetch(&objcount,1);
+		if (((unsigned)count * HASH_SHRINK) < GetBucketCount(__atomic_load_n(&tablestate,__ATOMIC_ACQUIRE))) MergeBucket();
 
 		// return one item deleted
 		return(1);
@@ -124,7 +163,7 @@ prev = NULL;
 	}
 
 // unlock the bucket
-pthread_mutex_unlock(&control[key]);
+pthread_mutex_unlock(Control(key));
 
 return(0);
 }
@@ -132,101 +171,275 @@ return(0);
 HashObject* HashTable::SearchObject(u_int64_t aValue)
 {
 HashObject	*find;
+u_int64_t	state;
+u_int32_t	before,after;
 unsigned	key;
+int			x;
+
+	// The caller must be in an epoch so nothing we find can be freed
+	// until it leaves.  A resize can move objects between chains while
+	// we walk one so a miss only counts if no resize happened meanwhile.
+	for(x = 0;x < HASH_RETRY;x++)
+	{
+	before = __atomic_load_n(&resizeseq,__ATOMIC_ACQUIRE);
+	if (before & 1) continue;
+
+	state = __atomic_load_n(&tablestate,__ATOMIC_ACQUIRE);
+	key = GetHashValue(aValue,state);
+
+		for(find = __atomic_load_n(&Bucket(key),__ATOMIC_ACQUIRE);find != NULL;find = __atomic_load_n(&find->next,__ATOMIC_ACQUIRE))
+		{
+		if (find->next == find) break;
+		if (aValue == find->netsession) return(find);
+		}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	after = __atomic_load_n(&resizeseq,__ATOMIC_RELAXED);
+	if (after == before) return(NULL);
+	}
 
-// calculate bucket using the hash function
-key = GetHashValue(aValue);
+// the table is busy resizing so do it the old fashioned way
+return(SearchLocked(aValue));
+}
+/*--------------------------------------------------------------------------*/
+HashObject* HashTable::SearchLocked(u_int64_t aValue)
+{
+HashObject	*find;
+unsigned	key;
 
-// lock the bucket
-pthread_mutex_lock(&control[key]);
+// lock the bucket where the object belongs
+key = LockBucket(aValue);
 
 	// if the bucket is empty unlock and return nothing
-	if (table[key] == NULL)
+	if (Bucket(key) == NULL)
 	{
-	pthread_mutex_unlock(&control[key]);
+	pthread_mutex_unlock(Control(key));
 	return(NULL);
 	}
 
 	// search for exact match or default
-	for(find = table[key];find != NULL;find = find->next)
+	for(find = Bucket(key);find != NULL;find = find->next)
 	{
 	if (find->next == find) break;
 	if (aValue != find->netsession) continue;
 
 	// unlock the bucket
-	pthread_mutex_unlock(&control[key]);
+	pthread_mutex_unlock(Control(key));
 
 	// return object found
 	return(find);
 	}
 
 // unlocko and return NULL if nothing found
-pthread_mutex_unlock(&control[key]);
+pthread_mutex_unlock(Control(key));
 return(NULL);
 }
 /*--------------------------------------------------------------------------*/
-int HashTable::PurgeStaleObjects(time_t aStamp)
+u_int64_t HashTable::GetHashValue(u_int64_t aValue,u_int64_t aState)
 {
-HashObject	*work;
-int			removed;
-int			x;
+u_int64_t	hash,size,key;
+
+// use the current size and if the bucket has already been
+// split use the size the table will have at the next level
+hash = session_hash(aValue);
+size = ((u_int64_t)basecount << (aState >> 32));
+key = (hash & (size - 1));
+if (key < (aState & 0xFFFFFFFF)) key = (hash & ((size << 1) - 1));
+return(key);
+}
+/*--------------------------------------------------------------------------*/
+unsigned HashTable::GetBucketCount(u_int64_t aState)
+{
+return((basecount << (aState >> 32)) + (aState & 0xFFFFFFFF));
+}
+/*--------------------------------------------------------------------------*/
+unsigned HashTable::LockBucket(u_int64_t aValue)
+{
+u_int64_t	state;
+unsigned	key;
 
-removed = 0;
+	// The table state can change between finding the bucket and locking
+	// it, but it only changes while the buckets involved are locked.  So
+	// once we have the lock we check the bucket is still the right one.
+	for(;;)
+	{
+	state = __atomic_load_n(&tablestate,__ATOMIC_ACQUIRE);
+	key = GetHashValue(aValue,state);
+	pthread_mutex_lock(Control(key));
+	state = __atomic_load_n(&tablestate,__ATOMIC_ACQUIRE);
+	if (GetHashValue(aValue,state) == key) return(key);
+	pthread_mutex_unlock(Control(key));
+	}
+}
+/*--------------------------------------------------------------------------*/
+void HashTable::SplitBucket(void)
+{
+HashObject	*work,*next,*keep,*move;
+u_int64_t	state,size,level,split;
+unsigned	source,target,x;
 
-	for(x = 0;x < buckets;x++)
+// only one thread resizes at a time and nobody has to wait for it
+if (pthread_mutex_trylock(&resizelock) != 0) return;
+
+state = tablestate;
+level = (state >> 32);
+split = (state & 0xFFFFFFFF);
+size = ((u_int64_t)basecount << level);
+
+	// make sure the table still needs to grow and has room to do so
+	if (((unsigned)objcount <= (GetBucketCount(state) * HASH_GROW)) || ((size << 1) > (u_int64_t)(HASH_SEGMENT * HASH_DIRECTORY)))
 	{
-	// lock the bucket
-	pthread_mutex_lock(&control[x]);
+	pthread_mutex_unlock(&resizelock);
+	return;
+	}
 
-		// check every object in each active table
-		if (table[x] != NULL)
-		{
-			for(work = table[x];work != NULL;work = work->next)
-			{
-			// ignore objects that aren't stale
-			if (aStamp < work->timeout) continue;
+// the bucket at the split pointer moves half its objects to the new bucket
+source = split;
+target = (size + split);
 
-			// object is stale so post a remove message to the classify thread
-			g_messagequeue->PushMessage(new MessageWagon(MSG_REMOVE,work->netsession));
-			removed++;
-			}
+	// allocate the segment for the new bucket the first time we need it
+	// and since we never free them the readers never see one disappear
+	if (directory[target / HASH_SEGMENT] == NULL)
+	{
+	directory[target / HASH_SEGMENT] = (HashSegment *)calloc(1,sizeof(HashSegment));
+	for(x = 0;x < (unsigned)HASH_SEGMENT;x++) pthread_mutex_init(&directory[target / HASH_SEGMENT]->control[x],NULL);
+	}
+
+pthread_mutex_lock(Control(source));
+pthread_mutex_lock(Control(target));
+
+// an odd sequence tells searches objects are moving between chains
+__atomic_store_n(&resizeseq,resizeseq + 1,__ATOMIC_RELAXED);
+__atomic_thread_fence(__ATOMIC_RELEASE);
+
+keep = NULL;
+move = Bucket(target);
+
+	// rehash every object in the old bucket using the next level size
+	for(work = Bucket(source);work != NULL;work = next)
+	{
+	next = work->next;
+
+		if ((session_hash(work->netsession) & ((size << 1) - 1)) == source)
+		{
+		work->next = keep;
+		keep = work;
 		}
 
-	// unlock the bucket
-	pthread_mutex_unlock(&control[x]);
+		else
+		{
+		work->next = move;
+		move = work;
+		}
 	}
 
-return(removed);
+Bucket(source) = keep;
+Bucket(target) = move;
+
+// advance the split pointer and go to the next level once every
+// bucket at this level has been split
+split++;
+if (split == size) state = ((level + 1) << 32);
+else state = ((level << 32) | split);
+__atomic_store_n(&tablestate,state,__ATOMIC_RELEASE);
+__atomic_store_n(&resizeseq,resizeseq + 1,__ATOMIC_RELEASE);
+
+pthread_mutex_unlock(Control(target));
+pthread_mutex_unlock(Control(source));
+pthread_mutex_unlock(&resizelock);
 }
 /*--------------------------------------------------------------------------*/
-u_int64_t HashTable::GetHashValue(u_int64_t aValue)
+void HashTable::MergeBucket(void)
 {
-return((u_int64_t)aValue % (u_int64_t)buckets);
+HashObject	*work;
+u_int64_t	state,size,level,split;
+unsigned	target,source;
+int			x;
+
+// only one thread resizes at a time and nobody has to wait for it
+if (pthread_mutex_trylock(&resizelock) != 0) return;
+
+	// Each call can merge several buckets so the table shrinks faster than
+	// objects are deleted and catches up once the load has dropped.
+	for(x = 0;x < HASH_MERGE;x++)
+	{
+	state = tablestate;
+	level = (state >> 32);
+	split = (state & 0xFFFFFFFF);
+
+	// make sure the table still needs to shrink and is above the minimum
+	if (((unsigned)objcount * HASH_SHRINK) >= GetBucketCount(state)) break;
+	if ((level == 0) && (split == 0)) break;
+
+		// back the split pointer up and drop to the previous level if needed
+		if (split == 0)
+		{
+		level--;
+		split = (((u_int64_t)basecount << level) - 1);
+		}
+
+		else
+		{
+		split--;
+		}
+
+	// the last bucket goes back into the bucket it was split from
+	size = ((u_int64_t)basecount << level);
+	target = split;
+	source = (size + split);
+
+	pthread_mutex_lock(Control(target));
+	pthread_mutex_lock(Control(source));
+
+	__atomic_store_n(&resizeseq,resizeseq + 1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		// append the old chain to the end of the new chain
+		if (Bucket(source) != NULL)
+		{
+		for(work = Bucket(source);work->next != NULL;work = work->next);
+		work->next = Bucket(target);
+		Bucket(target) = Bucket(source);
+		Bucket(source) = NULL;
+		}
+
+	__atomic_store_n(&tablestate,((level << 32) | split),__ATOMIC_RELEASE);
+	__atomic_store_n(&resizeseq,resizeseq + 1,__ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(Control(source));
+	pthread_mutex_unlock(Control(target));
+	}
+
+pthread_mutex_unlock(&resizelock);
 }
 /*--------------------------------------------------------------------------*/
 void HashTable::GetTableSize(int &aCount,int &aBytes)
 {
 HashObject	*work;
-int			x;
+unsigned	buckets,x;
 
 aCount = 0;
 aBytes = 0;
 
-// start with our size
+// hold the resize lock so objects don't move while we walk the table
+pthread_mutex_lock(&resizelock);
+buckets = GetBucketCount(tablestate);
+
+// start with our size and the directory and segments
 aBytes = sizeof(*this);
-aBytes+=(buckets * sizeof(HashObject *));
-aBytes+=(buckets * sizeof(pthread_mutex_t));
+aBytes+=(HASH_DIRECTORY * sizeof(HashSegment *));
+for(x = 0;x < (unsigned)HASH_DIRECTORY;x++) if (directory[x] != NULL) aBytes+=sizeof(HashSegment);
 
 	// walk through all of the table entries
 	for(x = 0;x < buckets;x++)
 	{
 	// lock the bucket
-	pthread_mutex_lock(&control[x]);
+	pthread_mutex_lock(Control(x));
 
 		// count and add the size of every object in active tables
-		if (table[x] != NULL)
+		if (Bucket(x) != NULL)
 		{
-			for(work = table[x];work != NULL;work = work->next)
+			for(work = Bucket(x);work != NULL;work = work->next)
 			{
 			aBytes+=work->GetObjectSize();
 			aCount++;
@@ -234,49 +447,89 @@ aBytes+=(buckets * sizeof(pthread_mutex_t));
 		}
 
 	// unlock the bucket
-	pthread_mutex_unlock(&control[x]);
+	pthread_mutex_unlock(Control(x));
 	}
+
+pthread_mutex_unlock(&resizelock);
+}
+/*--------------------------------------------------------------------------*/
+void HashTable::GetLoadStats(int &aBuckets,double &aLoad,int *aHistogram)
+{
+HashObject	*work;
+unsigned	buckets,x;
+int			count,total;
+
+// hold the resize lock so objects don't move while we walk the table
+pthread_mutex_lock(&resizelock);
+buckets = GetBucketCount(tablestate);
+
+memset(aHistogram,0,TABLE_HISTOGRAM * sizeof(int));
+total = 0;
+
+	// count the length of every chain with the last histogram
+	// entry holding all chains at least that long
+	for(x = 0;x < buckets;x++)
+	{
+	pthread_mutex_lock(Control(x));
+	count = 0;
+	for(work = Bucket(x);work != NULL;work = work->next) count++;
+	pthread_mutex_unlock(Control(x));
+
+	total+=count;
+	if (count >= TABLE_HISTOGRAM) count = (TABLE_HISTOGRAM - 1);
+	aHistogram[count]++;
+	}
+
+pthread_mutex_unlock(&resizelock);
+
+aBuckets = buckets;
+aLoad = ((double)total / (double)buckets);
 }
 /*--------------------------------------------------------------------------*/
 void HashTable::DumpDetail(FILE *aFile)
 {
 HashObject	*work;
 char		buffer[256];
+unsigned	buckets,x;
 int			count,bytes;
-int			x;
 
 count = 0;
 bytes = 0;
 
-// start with our size
+// hold the resize lock so objects don't move while we walk the table
+pthread_mutex_lock(&resizelock);
+buckets = GetBucketCount(tablestate);
+
+// start with our size and the directory and segments
 bytes = sizeof(*this);
-bytes+=(buckets * sizeof(HashObject *));
-bytes+=(buckets * sizeof(pthread_mutex_t));
+bytes+=(HASH_DIRECTORY * sizeof(HashSegment *));
+for(x = 0;x < (unsigned)HASH_DIRECTORY;x++) if (directory[x] != NULL) bytes+=sizeof(HashSegment);
 
 	// walk through all of the table entries
 	for(x = 0;x < buckets;x++)
 	{
 	// lock the bucket
-	pthread_mutex_lock(&control[x]);
+	pthread_mutex_lock(Control(x));
 
 		// count an add the size of every object
-		if (table[x] != NULL)
+		if (Bucket(x) != NULL)
 		{
-			for(work = table[x];work != NULL;work = work->next)
+			for(work = Bucket(x);work != NULL;work = work->next)
 			{
 			work->GetObjectString(buffer,sizeof(buffer));
-			fprintf(aFile,"  %d = %s\n",x,buffer);
+			fprintf(aFile,"  %u = %s\n",x,buffer);
 			bytes+=work->GetObjectSize();
 			count++;
 			}
 		}
 
 	// unlock the bucket
-	pthread_mutex_unlock(&control[x]);
+	pthread_mutex_unlock(Control(x));
 	}
 
+pthread_mutex_unlock(&resizelock);
+
 fprintf(aFile,"  TOTAL ITEMS = %d\n",count);
 fprintf(aFile,"  TOTAL BYTES = %d\n",bytes);
 }
 /*--------------------------------------------------------------------------*/
-
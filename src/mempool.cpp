@@ -0,0 +1,388 @@
+// MEMPOOL.CPP
+// Traffic Classification Engine
+// Copyright (c) 2011-2018 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+#include "classd.h"
+
+// Free blocks are chained using the first word of each block, and full
+// magazines in the depot are chained using the second word of the first
+// block in each magazine, so blocks need room for at least two pointers.
+#define BLOCK_NEXT(b)		(((void **)(b))[0])
+#define MAGAZINE_NEXT(b)	(((void **)(b))[1])
+
+// Pools created with a slab size carve their blocks out of slabs aligned
+// on the slab size so the slab for any block can be found with a mask.
+// The slab header is padded so the first block is cache line aligned.
+#define SLAB_HEADER			64
+#define SLAB_OWNER(b)		((PoolSlab *)((uintptr_t)(b) & ~(uintptr_t)(slabsize - 1)))
+
+/*--------------------------------------------------------------------------*/
+MemoryPool::MemoryPool(const char *aName,int aBlockSize,int aMagazine,int aRetain,int aSlabSize)
+{
+// save the pool parameters
+blocksize = aBlockSize;
+if (blocksize < (int)(2 * sizeof(void *))) blocksize = (2 * sizeof(void *));
+magazine = aMagazine;
+if (magazine < 1) magazine = 1;
+retain = aRetain;
+
+// slabs must be a power of two and blocks in a slab are kept aligned
+for(slabsize = 0;(aSlabSize > 0) && (slabsize < aSlabSize);slabsize = (slabsize == 0 ? SLAB_HEADER : slabsize << 1));
+if (slabsize != 0) blocksize = ((blocksize + 15) & ~15);
+slabblocks = (slabsize == 0 ? 0 : (slabsize - SLAB_HEADER) / blocksize);
+if (slabblocks == 0) slabsize = 0;
+partiallist = NULL;
+fulllist = NULL;
+slabcount = 0;
+
+strncpy(poolname,aName,sizeof(poolname));
+poolname[sizeof(poolname) - 1] = 0;
+
+cachelist = NULL;
+depotlist = NULL;
+depotcount = 0;
+hitcount = 0;
+misscount = 0;
+
+// initialize the depot and slab locks and the key for the per-thread caches
+pthread_mutex_init(&depotlock,NULL);
+pthread_mutex_init(&slablock,NULL);
+pthread_key_create(&cachekey,FreeCache);
+}
+/*--------------------------------------------------------------------------*/
+MemoryPool::~MemoryPool(void)
+{
+PoolCache	*cache;
+PoolSlab	*slab;
+void		*block,*hold;
+
+	// return any blocks cached by the calling thread
+	if ((cache = (PoolCache *)pthread_getspecific(cachekey)) != NULL)
+	{
+	pthread_setspecific(cachekey,NULL);
+	FreeCache(cache);
+	}
+
+pthread_key_delete(cachekey);
+
+	// free every block in every magazine in the depot
+	while (depotlist != NULL)
+	{
+	block = depotlist;
+	depotlist = MAGAZINE_NEXT(block);
+
+		while (block != NULL)
+		{
+		hold = BLOCK_NEXT(block);
+		ReleaseBlock(block);
+		block = hold;
+		}
+	}
+
+	// free any slabs that still have blocks in use
+	while ((slab = (partiallist != NULL ? partiallist : fulllist)) != NULL)
+	{
+	UnlinkSlab(slab == partiallist ? &partiallist : &fulllist,slab);
+	free(slab);
+	}
+
+pthread_mutex_destroy(&slablock);
+pthread_mutex_destroy(&depotlock);
+}
+/*--------------------------------------------------------------------------*/
+MemoryPool::PoolCache* MemoryPool::GetCache(void)
+{
+PoolCache	*cache;
+
+// most of the time the calling thread already has a cache
+cache = (PoolCache *)pthread_getspecific(cachekey);
+if (cache != NULL) return(cache);
+
+// first time this thread has used the pool so create a cache
+cache = (PoolCache *)calloc(1,sizeof(PoolCache));
+cache->pool = this;
+pthread_setspecific(cachekey,cache);
+
+// add the cache to our list so we can include it in the stats
+pthread_mutex_lock(&depotlock);
+cache->next = cachelist;
+cachelist = cache;
+pthread_mutex_unlock(&depotlock);
+
+return(cache);
+}
+/*--------------------------------------------------------------------------*/
+void* MemoryPool::GrabBlock(void)
+{
+PoolCache	*cache;
+void		*block;
+
+cache = GetCache();
+
+	// when the local cache is empty grab a full magazine from the depot
+	if (cache->count == 0)
+	{
+	pthread_mutex_lock(&depotlock);
+
+		if (depotlist != NULL)
+		{
+		cache->list = depotlist;
+		cache->count = magazine;
+		depotlist = MAGAZINE_NEXT(depotlist);
+		depotcount--;
+		}
+
+	pthread_mutex_unlock(&depotlock);
+	}
+
+	// nothing cached anywhere so we have to allocate a new block
+	if (cache->count == 0)
+	{
+	cache->misses++;
+	return(AllocateBlock());
+	}
+
+// take the first block from the local cache
+block = cache->list;
+cache->list = BLOCK_NEXT(block);
+cache->count--;
+cache->hits++;
+
+return(block);
+}
+/*--------------------------------------------------------------------------*/
+void MemoryPool::FreeBlock(void *aBlock)
+{
+PoolCache	*cache;
+
+cache = GetCache();
+
+// put the block at the front of the local cache
+BLOCK_NEXT(aBlock) = cache->list;
+cache->list = aBlock;
+cache->count++;
+
+// when the local cache gets too big we hand a magazine back to the depot
+if (cache->count >= (magazine * 2)) FlushMagazine(cache,magazine);
+}
+/*--------------------------------------------------------------------------*/
+void MemoryPool::FlushMagazine(PoolCache *aCache,int aCount)
+{
+void		*block,*hold;
+int			x;
+
+if (aCount == 0) return;
+
+// detach the requested number of blocks from the front of the cache
+block = aCache->list;
+for(x = 1;x < aCount;x++) block = BLOCK_NEXT(block);
+hold = aCache->list;
+aCache->list = BLOCK_NEXT(block);
+aCache->count-=aCount;
+BLOCK_NEXT(block) = NULL;
+block = hold;
+
+	// full magazines go to the depot until we reach the retain limit
+	if (aCount == magazine)
+	{
+	pthread_mutex_lock(&depotlock);
+
+		if (depotcount < retain)
+		{
+		MAGAZINE_NEXT(block) = depotlist;
+		depotlist = block;
+		depotcount++;
+		block = NULL;
+		}
+
+	pthread_mutex_unlock(&depotlock);
+	}
+
+	// anything we didn't keep goes back to the system
+	while (block != NULL)
+	{
+	hold = BLOCK_NEXT(block);
+	ReleaseBlock(block);
+	block = hold;
+	}
+}
+/*--------------------------------------------------------------------------*/
+void* MemoryPool::AllocateBlock(void)
+{
+PoolSlab	*slab;
+void		*block;
+
+// pools without slabs just use the system allocator
+if (slabsize == 0) return(malloc(blocksize));
+
+pthread_mutex_lock(&slablock);
+
+slab = partiallist;
+
+	// no slabs with free blocks so we need a new one
+	if (slab == NULL)
+	{
+		if (posix_memalign((void **)&slab,slabsize,slabsize) != 0)
+		{
+		pthread_mutex_unlock(&slablock);
+		return(NULL);
+		}
+
+	slab->freelist = NULL;
+	slab->carved = 0;
+	slab->used = 0;
+	LinkSlab(&partiallist,slab);
+	slabcount++;
+	}
+
+// Reuse freed blocks first and only carve new ones from the end of the
+// slab when needed so we don't touch pages until they are actually used.
+block = slab->freelist;
+if (block != NULL) slab->freelist = BLOCK_NEXT(block);
+else block = ((char *)slab + SLAB_HEADER + (slab->carved++ * blocksize));
+
+	// move the slab to the full list when the last block is taken
+	if (++slab->used == slabblocks)
+	{
+	UnlinkSlab(&partiallist,slab);
+	LinkSlab(&fulllist,slab);
+	}
+
+pthread_mutex_unlock(&slablock);
+
+return(block);
+}
+/*--------------------------------------------------------------------------*/
+void MemoryPool::ReleaseBlock(void *aBlock)
+{
+PoolSlab	*slab;
+
+	if (slabsize == 0)
+	{
+	free(aBlock);
+	return;
+	}
+
+slab = SLAB_OWNER(aBlock);
+
+pthread_mutex_lock(&slablock);
+
+BLOCK_NEXT(aBlock) = slab->freelist;
+slab->freelist = aBlock;
+
+	// a full slab goes to the front of the partial list so it gets
+	// filled again before we start taking blocks from emptier slabs
+	if (slab->used-- == slabblocks)
+	{
+	UnlinkSlab(&fulllist,slab);
+	LinkSlab(&partiallist,slab);
+	}
+
+	// give empty slabs back to the system but keep the last one
+	// around so a single session doesn't keep creating a new slab
+	if ((slab->used == 0) && ((partiallist != slab) || (slab->next != NULL)))
+	{
+	UnlinkSlab(&partiallist,slab);
+	free(slab);
+	slabcount--;
+	}
+
+pthread_mutex_unlock(&slablock);
+}
+/*--------------------------------------------------------------------------*/
+void MemoryPool::LinkSlab(PoolSlab **aList,PoolSlab *aSlab)
+{
+aSlab->prev = NULL;
+aSlab->next = *aList;
+if (*aList != NULL) (*aList)->prev = aSlab;
+*aList = aSlab;
+}
+/*--------------------------------------------------------------------------*/
+void MemoryPool::UnlinkSlab(PoolSlab **aList,PoolSlab *aSlab)
+{
+if (aSlab->prev != NULL) aSlab->prev->next = aSlab->next;
+else *aList = aSlab->next;
+if (aSlab->next != NULL) aSlab->next->prev = aSlab->prev;
+}
+/*--------------------------------------------------------------------------*/
+void MemoryPool::FreeCache(void *aCache)
+{
+PoolCache	*cache = (PoolCache *)aCache;
+MemoryPool	*pool = cache->pool;
+PoolCache	*work,*prev;
+
+// called when a thread exits to return everything it has cached
+while (cache->count >= pool->magazine) pool->FlushMagazine(cache,pool->magazine);
+pool->FlushMagazine(cache,cache->count);
+
+pthread_mutex_lock(&pool->depotlock);
+
+// keep the counters from the cache
+pool->hitcount+=cache->hits;
+pool->misscount+=cache->misses;
+
+prev = NULL;
+
+	// remove the cache from the list
+	for(work = pool->cachelist;work != NULL;work = work->next)
+	{
+		if (work == cache)
+		{
+		if (prev == NULL) pool->cachelist = work->next;
+		else prev->next = work->next;
+		break;
+		}
+
+	prev = work;
+	}
+
+pthread_mutex_unlock(&pool->depotlock);
+
+free(cache);
+}
+/*--------------------------------------------------------------------------*/
+void MemoryPool::GetPoolStats(u_int64_t &aHits,u_int64_t &aMisses,int &aIdle)
+{
+PoolCache	*work;
+
+pthread_mutex_lock(&depotlock);
+
+aHits = hitcount;
+aMisses = misscount;
+aIdle = (depotcount * magazine);
+
+	// include the counters from all the active thread caches
+	for(work = cachelist;work != NULL;work = work->next)
+	{
+	aHits+=work->hits;
+	aMisses+=work->misses;
+	aIdle+=work->count;
+	}
+
+pthread_mutex_unlock(&depotlock);
+}
+/*--------------------------------------------------------------------------*/
+void MemoryPool::GetSlabStats(int &aCount,int &aBytes,int *aHistogram)
+{
+PoolSlab	*work;
+int			x;
+
+for(x = 0;x < SLAB_HISTOGRAM;x++) aHistogram[x] = 0;
+
+pthread_mutex_lock(&slablock);
+
+aCount = slabcount;
+aBytes = (slabcount * slabsize);
+
+// Count the slabs by the fraction of blocks in use with the last bucket
+// only holding full slabs.  Blocks sitting in the thread caches and the
+// depot are counted as in use since they haven't gone back to the slab.
+for(work = partiallist;work != NULL;work = work->next) aHistogram[(work->used * (SLAB_HISTOGRAM - 1)) / slabblocks]++;
+for(work = fulllist;work != NULL;work = work->next) aHistogram[SLAB_HISTOGRAM - 1]++;
+
+pthread_mutex_unlock(&slablock);
+}
+/*--------------------------------------------------------------------------*/
@@ -6,22 +6,46 @@
 
 #include "common.h"
 #include "classd.h"
+
+// Every wagon is preceded by a small header that tells us which pool the
+// block came from and how much inline payload space follows the wagon.
+struct WagonHeader
+{
+	MemoryPool		*pool;
+	int				capacity;
+};
+
+#define WAGON_HEADER	16
+
+// the inline payload size, magazine size, and depot limit for each pool
+static const char *l_wagonname[3] = { "Small","Medium","Large" };
+static const int l_wagonsize[3] = { 0x100,0x800,0x8000 };
+static const int l_wagonmags[3] = { 64,32,8 };
+static const int l_wagonkeep[3] = { 64,32,16 };
 /*--------------------------------------------------------------------------*/
-MessageQueue::MessageQueue(void)
+MessageQueue::MessageQueue(int aLimit)
 {
-// initialize our head and tail pointers
-ListHead = ListTail = NULL;
-memset(&MessageSignal,0,sizeof(MessageSignal));
-memset(&ListLock,0,sizeof(ListLock));
+unsigned	size;
+
+// save the maximum number of messages we allow in the queue
+limit = aLimit;
+if (limit < 1) limit = 1;
 
-// initialize our lock mutex
-memset(&ListLock,0,sizeof(ListLock));
-pthread_mutex_init(&ListLock,NULL);
+// The ring is a power of two at least as large as the limit so the limit
+// check in PushMessage also guarantees the target slot has been released.
+// Empty slots are NULL so the calloc memory is only touched when used.
+for(size = 16;size < (unsigned)limit;size = (size << 1));
+ring = (MessageWagon **)calloc(size,sizeof(MessageWagon *));
+ringmask = (size - 1);
 
-// create our signal semaphore
-sem_init(&MessageSignal,0,0);
+pushpos = 0;
+pullpos = 0;
+sleeping = 0;
+
+// there is no point spinning for messages with only a single processor
+if (sysconf(_SC_NPROCESSORS_ONLN) > 1) spinlimit = 256;
+else spinlimit = 0;
 
-curr_count = 0;
 curr_bytes = 0;
 high_count = 0;
 high_bytes = 0;
@@ -29,114 +53,144 @@ high_bytes = 0;
 /*--------------------------------------------------------------------------*/
 MessageQueue::~MessageQueue(void)
 {
-// clean up our signal semaphore
-sem_destroy(&MessageSignal);
+MessageWagon		*local;
 
-// clean up our lock mutex
-pthread_mutex_destroy(&ListLock);
+// cleanup any messages left in the queue
+while (PullBatch(&local,1) != 0) delete(local);
 
-	// cleanup any messages left in the queue
-	while (ListHead != NULL)
-	{
-	ListTail = ListHead->next;
-	delete(ListHead);
-	ListHead = ListTail;
-	}
+free(ring);
 }
 /*--------------------------------------------------------------------------*/
 void MessageQueue::PushMessage(MessageWagon *argMessage)
 {
-// lock our mutex
-pthread_mutex_lock(&ListLock);
-
-	// if we have reached the configured limit just throw it away
-	if (curr_count >= cfg_packet_maximum)
-	{
-	// delete the message and increment the counter
-	delete(argMessage);
-	msg_sizedrop++;
-
-	// unlock our mutex
-	pthread_mutex_unlock(&ListLock);
-	return;
-	}
+unsigned		pos,count;
+int				bytes;
 
-	// if queue is empty assign message to tail pointer
-	if (ListTail == NULL)
-	{
-	ListTail = argMessage;
-	}
+pos = __atomic_load_n(&pushpos,__ATOMIC_RELAXED);
 
-	// otherwise append to the current tail object
-	else
+	// claim the next position in the ring
+	do
 	{
-	ListTail->next = argMessage;
-	ListTail = argMessage;
-	}
+	count = (pos - __atomic_load_n(&pullpos,__ATOMIC_ACQUIRE));
 
-// if head is null copy the tail
-if (ListHead == NULL) ListHead = ListTail;
+		// if we have reached the configured limit just throw it away
+		if (count >= (unsigned)limit)
+		{
+		delete(argMessage);
+		__sync_fetch_and_add(&msg_sizedrop,1);
+		return;
+		}
+	} while (__atomic_compare_exchange_n(&pushpos,&pos,pos + 1,1,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED) == 0);
 
 // increment our count and memory trackers
-curr_count++;
-if (curr_count > high_count) high_count = curr_count;
-curr_bytes+=argMessage->length;
-if (curr_bytes > high_bytes) high_bytes = curr_bytes;
+if ((int)count >= high_count) high_count = (count + 1);
+bytes = __sync_add_and_fetch(&curr_bytes,argMessage->length);
+if (bytes > high_bytes) high_bytes = bytes;
 
 // increment the packet counter
-msg_totalcount++;
+__sync_fetch_and_add(&msg_totalcount,1);
 
-// unlock our mutex
-pthread_mutex_unlock(&ListLock);
+// store the message in the slot we claimed which makes it visible to the consumer
+__atomic_store_n(&ring[pos & ringmask],argMessage,__ATOMIC_RELEASE);
 
-// increment the message signal semaphore
-sem_post(&MessageSignal);
+// if the consumer went to sleep waiting for messages wake it up
+__atomic_thread_fence(__ATOMIC_SEQ_CST);
+if (__atomic_load_n(&sleeping,__ATOMIC_RELAXED) == 0) return;
+if (__atomic_exchange_n(&sleeping,0,__ATOMIC_ACQ_REL) == 0) return;
+syscall(SYS_futex,&sleeping,FUTEX_WAKE_PRIVATE,1,NULL,NULL,0);
 }
 /*--------------------------------------------------------------------------*/
-MessageWagon* MessageQueue::GrabMessage(void)
+int MessageQueue::PullBatch(MessageWagon **argList,int argMaximum)
 {
 MessageWagon		*local;
+MessageWagon		**slot;
+unsigned			pos;
+int					bytes,count;
 
-// wait for a message
-sem_wait(&MessageSignal);
-
-// lock our mutex
-pthread_mutex_lock(&ListLock);
+pos = pullpos;
+bytes = 0;
 
-	// list is empty
-	if (ListHead == NULL)
+	// only the thread that owns the queue pulls messages so no locking is
+	// needed and we can detach a whole run of messages in a single pass
+	for(count = 0;count < argMaximum;count++)
 	{
-	local = NULL;
-	}
+	slot = &ring[pos & ringmask];
+	local = __atomic_load_n(slot,__ATOMIC_ACQUIRE);
+	if (local == NULL) break;
 
-	// list has single item
-	else if (ListHead == ListTail)
-	{
-	local = ListHead;
-	ListHead = ListTail = NULL;
+	// clear the slot so it is ready when we release it to the producers
+	*slot = NULL;
+	argList[count] = local;
+	bytes+=local->length;
+	pos++;
 	}
 
-	// grab the first item in the list
-	else
-	{
-	local = ListHead;
-	ListHead = local->next;
-	}
+if (count == 0) return(0);
 
-// decrement our counter
-curr_count--;
-if (local != NULL) curr_bytes-=local->length;
+// release all of the slots we grabbed back to the producers at once
+__atomic_store_n(&pullpos,pos,__ATOMIC_RELEASE);
+__sync_fetch_and_sub(&curr_bytes,bytes);
 
-// unlock our mutex
-pthread_mutex_unlock(&ListLock);
+return(count);
+}
+/*--------------------------------------------------------------------------*/
+MessageWagon* MessageQueue::GrabMessage(void)
+{
+MessageWagon		*local;
 
-// return the message
+GrabBatch(&local,1);
 return(local);
 }
 /*--------------------------------------------------------------------------*/
+int MessageQueue::GrabBatch(MessageWagon **argList,int argMaximum)
+{
+int					count,x;
+
+	for(;;)
+	{
+		// spin for a bit since under load the next message is usually
+		// only a few moments away and that is cheaper than sleeping
+		for(x = 0;x < spinlimit;x++)
+		{
+		count = PullBatch(argList,argMaximum);
+
+			// adapt the spin limit based on whether spinning paid off
+			if (count != 0)
+			{
+			if (spinlimit < 4096) spinlimit = (spinlimit << 1);
+			return(count);
+			}
+
+#if defined(__i386__) || defined(__x86_64__)
+		__asm__ __volatile__("pause");
+#elif defined(__aarch64__) || (defined(__ARM_ARCH) && (__ARM_ARCH >= 7))
+		__asm__ __volatile__("yield");
+#endif
+		}
+
+	if (spinlimit > 64) spinlimit = (spinlimit >> 1);
+
+	// let the producers know we are going to sleep and then check
+	// one last time so we can't miss a message pushed in the meantime
+	__atomic_store_n(&sleeping,1,__ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	count = PullBatch(argList,argMaximum);
+
+		if (count != 0)
+		{
+		__atomic_store_n(&sleeping,0,__ATOMIC_RELAXED);
+		return(count);
+		}
+
+	// wait for a producer to clear the sleeping flag and wake us up
+	syscall(SYS_futex,&sleeping,FUTEX_WAIT_PRIVATE,1,NULL,NULL,0);
+	__atomic_store_n(&sleeping,0,__ATOMIC_RELAXED);
+	}
+}
+/*--------------------------------------------------------------------------*/
 void MessageQueue::GetQueueSize(int &aCurr_count,int &aCurr_bytes,int &aHigh_count,int &aHigh_bytes)
 {
-aCurr_count = curr_count;
+aCurr_count = (int)(__atomic_load_n(&pushpos,__ATOMIC_RELAXED) - __atomic_load_n(&pullpos,__ATOMIC_RELAXED));
 aCurr_bytes = curr_bytes;
 aHigh_count = high_count;
 aHigh_bytes = high_bytes;
@@ -145,47 +199,139 @@ aHigh_bytes = high_bytes;
 /*--------------------------------------------------------------------------*/
 MessageWagon::MessageWagon(u_int8_t argCommand,u_int64_t argIndex,const void *argBuffer,int argLength)
 {
-next = NULL;
 command = argCommand;
 index = argIndex;
 length = argLength;
-buffer = (unsigned char *)malloc(argLength);
+buffer = GrabPayload(argLength);
 memcpy(buffer,argBuffer,argLength);
-timestamp = time(NULL);
+timestamp = g_clock;
+}
+/*--------------------------------------------------------------------------*/
+MessageWagon::MessageWagon(u_int8_t argCommand,u_int64_t argIndex,int argLength)
+{
+// the caller is responsible for filling the payload buffer
+command = argCommand;
+index = argIndex;
+length = argLength;
+buffer = GrabPayload(argLength);
+timestamp = g_clock;
 }
 /*--------------------------------------------------------------------------*/
 MessageWagon::MessageWagon(u_int8_t argCommand,const char *argString)
 {
-next = NULL;
 command = argCommand;
 index = 0;
 length = (strlen(argString) + 1);
-buffer = (unsigned char *)malloc(length);
+buffer = GrabPayload(length);
 strcpy((char *)buffer,argString);
-timestamp = time(NULL);
+timestamp = g_clock;
 }
 /*--------------------------------------------------------------------------*/
 MessageWagon::MessageWagon(u_int8_t argCommand,u_int64_t argIndex)
 {
-next = NULL;
 command = argCommand;
 index = argIndex;
 length = 0;
 buffer = NULL;
+timestamp = g_clock;
 }
 /*--------------------------------------------------------------------------*/
 MessageWagon::MessageWagon(u_int8_t argCommand)
 {
-next = NULL;
 command = argCommand;
 index = 0;
 length = 0;
 buffer = NULL;
+timestamp = g_clock;
 }
 /*--------------------------------------------------------------------------*/
 MessageWagon::~MessageWagon(void)
 {
-if (buffer != NULL) free(buffer);
+// only free the payload if it didn't fit in the inline space
+if ((buffer != NULL) && (buffer != (char *)this + sizeof(*this))) free(buffer);
+}
+/*--------------------------------------------------------------------------*/
+void* MessageWagon::GrabPayload(int argLength)
+{
+WagonHeader		*header;
+
+// use the inline space following the wagon when the payload will fit
+header = (WagonHeader *)((char *)this - WAGON_HEADER);
+if (argLength <= header->capacity) return((char *)this + sizeof(*this));
+
+return(malloc(argLength));
+}
+/*--------------------------------------------------------------------------*/
+void* MessageWagon::operator new(size_t aSize,int aExtra)
+{
+WagonHeader		*header;
+int				x;
+
+	// use the smallest pool with enough inline space for the payload
+	for(x = 0;x < 3;x++)
+	{
+	if (g_wagonpool[x] == NULL) continue;
+	if (aExtra > l_wagonsize[x]) continue;
+
+	header = (WagonHeader *)g_wagonpool[x]->GrabBlock();
+
+	// if the pool can't get a block we fall back to malloc below
+	if (header == NULL) break;
+
+	header->pool = g_wagonpool[x];
+	header->capacity = l_wagonsize[x];
+	return((char *)header + WAGON_HEADER);
+	}
+
+// too big for any of the pools so allocate exactly what we need
+header = (WagonHeader *)malloc(WAGON_HEADER + aSize + aExtra);
+if (header == NULL) throw std::bad_alloc();
+header->pool = NULL;
+header->capacity = aExtra;
+return((char *)header + WAGON_HEADER);
+}
+/*--------------------------------------------------------------------------*/
+void* MessageWagon::operator new(size_t aSize)
+{
+return(operator new(aSize,0));
+}
+/*--------------------------------------------------------------------------*/
+void MessageWagon::operator delete(void *aObject,int)
+{
+operator delete(aObject);
+}
+/*--------------------------------------------------------------------------*/
+void MessageWagon::operator delete(void *aObject)
+{
+WagonHeader		*header;
+
+if (aObject == NULL) return;
+
+// return the block to the pool it came from
+header = (WagonHeader *)((char *)aObject - WAGON_HEADER);
+if (header->pool != NULL) header->pool->FreeBlock(header);
+else free(header);
+}
+/*--------------------------------------------------------------------------*/
+void MessageWagon::CreatePools(void)
+{
+int		x;
+
+// wagons are allocated with the payload space following the
+// wagon object so each pool block holds all three pieces
+for(x = 0;x < 3;x++) g_wagonpool[x] = new MemoryPool(l_wagonname[x],WAGON_HEADER + sizeof(MessageWagon) + l_wagonsize[x],l_wagonmags[x],l_wagonkeep[x]);
 }
 /*--------------------------------------------------------------------------*/
+void MessageWagon::DeletePools(void)
+{
+MemoryPool		*pool;
+int				x;
 
+	for(x = 0;x < 3;x++)
+	{
+	pool = g_wagonpool[x];
+	g_wagonpool[x] = NULL;
+	delete(pool);
+	}
+}
+/*--------------------------------------------------------------------------*/
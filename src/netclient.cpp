@@ -6,20 +6,45 @@
 
 #include "common.h"
 #include "classd.h"
+
+// all clients subscribed to classification events are linked here
+static pthread_mutex_t l_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static NetworkClient *l_subscriber_list = NULL;
 /*--------------------------------------------------------------------------*/
 NetworkClient::NetworkClient(int aSock)
 {
 const char			*username;
 unsigned			size;
+int					type;
 
 // initialize our member variables
-querybuff[0] = 0;
-replybuff[0] = 0;
 queryoff = 0;
 replyoff = 0;
 dataloc = 0;
 datalen = 0;
+replysent = 0;
+binarymode = 0;
+binaryopcode = 0;
+noreply = 0;
+quietflag = 0;
+packetmode = 0;
+packetring = NULL;
+passfd[0] = -1;
+passfd[1] = -1;
+passcount = 0;
+nextsub = NULL;
+nextready = NULL;
+eventhead = NULL;
+eventtail = NULL;
+eventready = NULL;
+eventcount = 0;
+eventsock = -1;
+subscribed = 0;
+chunkwagon = NULL;
+chunkoff = 0;
+deadflag = 0;
 next = NULL;
+prev = NULL;
 
 // accept the inbound connection
 memset(&netaddr,0,sizeof(netaddr));
@@ -35,18 +60,66 @@ netsock = accept(aSock,(sockaddr *)&netaddr,(socklen_t *)&size);
 	throw(new Problem("Error returned from accept()",errno));
 	}
 
-// construct network name string for logging and such
-username = inet_ntoa(netaddr.sin_addr);
-if (username == NULL) username = "xxx.xxx.xxx.xxx";
-sprintf(netname,"%s:%d",username,netaddr.sin_port);
+// the destructor won't run if we throw so only allocate
+// the buffers once we know we have a connected client
+querysize = QUERY_MINIMUM;
+querybuff = (char *)malloc(querysize);
+replysize = REPLY_MINIMUM;
+replybuff = (char *)malloc(replysize);
+querybuff[0] = 0;
+replybuff[0] = 0;
+
+	// local clients don't have an address so we use the socket number
+	// for the name and check for the record based packet socket type
+	if (netaddr.sin_family == AF_UNIX)
+	{
+	type = 0;
+	size = sizeof(type);
+	getsockopt(netsock,SOL_SOCKET,SO_TYPE,&type,(socklen_t *)&size);
+	if (type == SOCK_SEQPACKET) packetmode = 1;
+	sprintf(netname,"%s:%d",(packetmode == 0 ? "stream" : "packet"),netsock);
+	}
+
+	// construct network name string for logging and such
+	else
+	{
+	username = inet_ntoa(netaddr.sin_addr);
+	if (username == NULL) username = "xxx.xxx.xxx.xxx";
+	sprintf(netname,"%s:%d",username,netaddr.sin_port);
+	}
 
 LOGMESSAGE(CAT_CLIENT,LOG_DEBUG,"NETCLIENT CONNECT: %s\n",netname);
 }
 /*--------------------------------------------------------------------------*/
 NetworkClient::~NetworkClient(void)
 {
+SessionEvent	*event;
+
 LOGMESSAGE(CAT_CLIENT,LOG_DEBUG,"NETCLIENT GOODBYE: %s\n",netname);
 
+// make sure we are no longer subscribed for events
+Unsubscribe();
+
+	// discard any events that were grabbed but never formatted
+	while (eventready != NULL)
+	{
+	event = eventready;
+	eventready = event->next;
+	free(event);
+	}
+
+// stop the shared memory ring and close any descriptors the client
+// passed that were never claimed by a command
+if (packetring != NULL) delete(packetring);
+DiscardPassed();
+
+// cleanup any chunk that was still being received
+if (chunkwagon != NULL) delete(chunkwagon);
+
+// free the query and reply buffers
+free(querybuff);
+free(replybuff);
+
 // shutdown and close the socket
 shutdown(netsock,SHUT_RDWR);
 close(netsock);
@@ -54,70 +127,272 @@ close(netsock);
 /*--------------------------------------------------------------------------*/
 int NetworkClient::NetworkHandler(void)
 {
-char	*crloc,*lfloc;
-int		ret;
+char	*target;
+int		ret,size;
+
+	// The socket is non-blocking and registered edge triggered so we
+	// keep going until the kernel tells us there is nothing left to read
+	// or the reply can't be written.  All state needed to resume a partial
+	// command, chunk, or reply lives in the client object so we never wait
+	// here for a slow peer and hold up all the other clients.
+	for(;;)
+	{
+		// Handle every complete command in the query buffer and append
+		// each reply to the reply buffer so clients can pipeline requests
+		// without waiting for the reply to each one.  We stop when the
+		// reply backlog gets large so a client that sends a stream of
+		// requests but never reads the replies can't consume memory.
+		while ((chunkwagon == NULL) && (replyoff - replysent < REPLY_BACKLOG))
+		{
+		ret = HandleCommand();
+		if (ret == 0) return(0);
+		if (ret == 1) break;
+		}
+
+		// send all the replies we have collected with a single call
+		if (replyoff != 0)
+		{
+		ret = TransmitReply();
+		if (ret == 0) return(0);
+		if (replyoff != 0) return(1);
+		continue;
+		}
+
+		// chunk data is received directly into the wagon buffer
+		if (chunkwagon != NULL)
+		{
+		target = ((char *)chunkwagon->buffer + chunkoff);
+		size = (chunkwagon->length - chunkoff);
+		}
+
+		// otherwise read to the current offset in our query buffer
+		// leaving room for the null terminator we add after each read
+		else
+		{
+		target = &querybuff[queryoff];
+		size = (querysize - queryoff - 1);
+		}
+
+		// packet sockets discard whatever part of a record doesn't fit
+		// so we peek at the record size and receive anything too big
+		// for the target into the query buffer after growing it
+		if (packetmode != 0)
+		{
+		ret = ReceivePacket(size);
+		if (ret == 0) return(0);
+		if (ret == 1) return(1);
+		if (ret == 2) continue;
+		}
+
+	ret = ReceiveData(target,size);
+
+	// if the client closed the connection return zero
+	// to let the server thread know we're done
+	if (ret == 0) return(0);
+
+		// return of less than zero and we log the error
+		// and let the server thread know we're done
+		if (ret < 0)
+		{
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return(1);
+		if (errno == EINTR) continue;
+		sysmessage(LOG_ERR,"Error %d returned from recv(%s)\n",errno,netname);
+		return(0);
+		}
+
+		// add the receive count to the chunk offset and
+		// handle the chunk once we have received all of it
+		if (chunkwagon != NULL)
+		{
+		chunkoff+=ret;
+		if (chunkoff == chunkwagon->length) CompleteChunk();
+		continue;
+		}
+
+	// add the receive count to the offset and null terminate the buffer
+	queryoff+=ret;
+	querybuff[queryoff] = 0;
+	}
+}
+/*--------------------------------------------------------------------------*/
+int NetworkClient::ReceivePacket(int size)
+{
+long		count;
+int			ret;
 
-// read data from the client to the current offset in our recv buffer
-ret = recv(netsock,&querybuff[queryoff],sizeof(querybuff) - queryoff,0);
+ret = recv(netsock,NULL,0,MSG_PEEK | MSG_TRUNC);
 
-// if the client closed the connection return zero
-// to let the server thread know we're done
+// zero means the client closed the connection
 if (ret == 0) return(0);
 
-	// return of less than zero and we log the error
-	// and let the server thread know we're done
 	if (ret < 0)
 	{
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return(1);
+	if (errno == EINTR) return(2);
+	sysmessage(LOG_ERR,"Error %d returned from recv(%s)\n",errno,netname);
+	return(0);
+	}
+
+// return three to let the caller receive directly into the target
+if (ret <= size) return(3);
+
+	// make room for the whole record in the query buffer
+	if (GrowQuery(queryoff + ret + 1) == 0)
+	{
+	sysmessage(LOG_WARNING,"Packet buffer overflow from netclient %s\n",netname);
+	return(0);
+	}
+
+ret = ReceiveData(&querybuff[queryoff],ret);
+
+	if (ret <= 0)
+	{
+	if ((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) return(1);
+	if ((ret < 0) && (errno == EINTR)) return(2);
 	sysmessage(LOG_ERR,"Error %d returned from recv(%s)\n",errno,netname);
 	return(0);
 	}
 
-// add the receive count to the offset and null terminate the buffer
 queryoff+=ret;
 querybuff[queryoff] = 0;
 
-// look for CR or LF characters
-crloc = strchr(querybuff,'\r');
-lfloc = strchr(querybuff,'\n');
+	// a pending chunk can only be waiting for data when the query buffer
+	// was empty so we move the rest of the chunk from the front of the
+	// record into the wagon and leave anything after it for the parser
+	if (chunkwagon != NULL)
+	{
+	count = (chunkwagon->length - chunkoff);
+	if (count > queryoff) count = queryoff;
+	memcpy((char *)chunkwagon->buffer + chunkoff,querybuff,count);
+	chunkoff+=count;
+	queryoff-=count;
+	memmove(querybuff,&querybuff[count],queryoff + 1);
+	if (chunkoff == chunkwagon->length) CompleteChunk();
+	}
 
-// if we don't find any return one to keep session active
-if ((crloc == NULL) && (lfloc == NULL)) return(1);
+return(2);
+}
+/*--------------------------------------------------------------------------*/
+int NetworkClient::ReceiveData(char *target,int size)
+{
+union { struct cmsghdr align; char data[CMSG_SPACE(sizeof(int) * 4)]; } control;
+struct cmsghdr	*cmsg;
+struct msghdr	msg;
+struct iovec	iov;
+int				*list;
+int				ret,tot,x;
+
+// network clients can't pass descriptors so we use a simple recv
+if (netaddr.sin_family != AF_UNIX) return(recv(netsock,target,size,0));
+
+memset(&msg,0,sizeof(msg));
+iov.iov_base = target;
+iov.iov_len = size;
+msg.msg_iov = &iov;
+msg.msg_iovlen = 1;
+msg.msg_control = control.data;
+msg.msg_controllen = sizeof(control.data);
+
+ret = recvmsg(netsock,&msg,MSG_CMSG_CLOEXEC);
+if (ret < 0) return(ret);
+
+	// keep descriptors passed by local clients for the command that
+	// follows and close any we don't have room for
+	for(cmsg = CMSG_FIRSTHDR(&msg);cmsg != NULL;cmsg = CMSG_NXTHDR(&msg,cmsg))
+	{
+	if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)) continue;
+	list = (int *)CMSG_DATA(cmsg);
+	tot = ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
 
-// set dataloc to the offset and datalen to the size of any data following LF
-dataloc = (lfloc - querybuff + 1);
-datalen = (queryoff - dataloc);
+	DiscardPassed();
 
-// wipe any CR or LF characters so they aren't included
-// in the command string we received from the client
-if (crloc != NULL) crloc[0] = 0;
-if (lfloc != NULL) lfloc[0] = 0;
+		for(x = 0;x < tot;x++)
+		{
+		if (passcount < 2) passfd[passcount++] = list[x];
+		else close(list[x]);
+		}
+	}
 
-LOGMESSAGE(CAT_CLIENT,LOG_DEBUG,"NETCLIENT COMMAND: %s = %s\n",netname,querybuff);
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+void NetworkClient::DiscardPassed(void)
+{
+int		x;
 
-// handle the request
-ret = ProcessRequest();
-if (ret == 0) return(0);
+for(x = 0;x < passcount;x++) close(passfd[x]);
+passfd[0] = -1;
+passfd[1] = -1;
+passcount = 0;
+}
+/*--------------------------------------------------------------------------*/
+int NetworkClient::HandleCommand(void)
+{
+char	*lfloc;
+int		ret;
 
-// hande the reply
-ret = TransmitReply();
-if (ret == 0) return(0);
+// make sure there is plenty of room to append the reply
+ReserveReply(REPLY_MINIMUM);
 
-// we processed something so clear all buffers and variables
-querybuff[0] = 0;
-replybuff[0] = 0;
-queryoff = 0;
-replyoff = 0;
+	// clients using the binary protocol have a separate parser that
+	// sets dataloc and datalen after the request has been handled
+	if (binarymode != 0)
+	{
+	ret = ProcessBinary();
+	if (ret != 2) return(ret);
+	}
+
+	else
+	{
+	// look for the LF that terminates the command
+	lfloc = strchr(querybuff,'\n');
+
+		// if we don't find it return one to wait for more data growing the
+		// buffer for long commands like a batch lookup unless it is already
+		// at the limit in which case the client is sending garbage
+		if (lfloc == NULL)
+		{
+		if (queryoff < querysize - 1) return(1);
+		if (GrowQuery(querysize * 2) != 0) return(1);
+		sysmessage(LOG_WARNING,"Command buffer overflow from netclient %s\n",netname);
+		return(0);
+		}
+
+	// set dataloc to the offset and datalen to the size of any data following LF
+	dataloc = (lfloc - querybuff + 1);
+	datalen = (queryoff - dataloc);
+
+	// wipe the CR and LF characters so they aren't included
+	// in the command string we received from the client
+	lfloc[0] = 0;
+	if ((lfloc > querybuff) && (lfloc[-1] == '\r')) lfloc[-1] = 0;
+
+	LOGMESSAGE(CAT_CLIENT,LOG_DEBUG,"NETCLIENT COMMAND: %s = %s\n",netname,querybuff);
+
+	// handle the request
+	ret = ProcessRequest();
+	if (ret == 0) return(0);
+	}
+
+// shift anything the request didn't consume to the front of the buffer
+if (datalen != 0) memmove(querybuff,&querybuff[dataloc],datalen);
+queryoff = datalen;
+querybuff[queryoff] = 0;
 dataloc = 0;
 datalen = 0;
 
-return(1);
+// return two to let the caller know we handled a command
+return(2);
 }
 /*--------------------------------------------------------------------------*/
 int NetworkClient::ProcessRequest(void)
 {
 SessionObject		*local;
 u_int64_t			hashcode;
-char				namestr[256];
+
+// commands that would normally get a reply we don't need are silent
+// when the client has asked us not to send them
+quietflag = noreply;
 
 // first check for all our special queries
 if (strcasecmp(querybuff,"CONFIG") == 0)	{ BuildConfiguration(); return(1); }
@@ -129,6 +404,51 @@ if (strcasecmp(querybuff,"DUMP") == 0)		{ DumpEverything(); return(1); }
 if (strcasecmp(querybuff,"EXIT") == 0)		{ return(0); }
 if (strcasecmp(querybuff,"QUIT") == 0) 		{ return(0); }
 
+	// disable or enable replies to create, remove, and chunk commands
+	if (strcasecmp(querybuff,"NOREPLY") == 0)
+	{
+	replyoff+=sprintf(&replybuff[replyoff],"NOREPLY: OK\r\n\r\n");
+	noreply = 1;
+	return(1);
+	}
+
+	if (strcasecmp(querybuff,"REPLY") == 0)
+	{
+	replyoff+=sprintf(&replybuff[replyoff],"REPLY: OK\r\n\r\n");
+	noreply = 0;
+	return(1);
+	}
+
+	// turn classification change events on or off
+	if (strcasecmp(querybuff,"SUBSCRIBE") == 0)
+	{
+	replyoff+=sprintf(&replybuff[replyoff],"SUBSCRIBE: OK\r\n\r\n");
+	Subscribe();
+	return(1);
+	}
+
+	if (strcasecmp(querybuff,"UNSUBSCRIBE") == 0)
+	{
+	replyoff+=sprintf(&replybuff[replyoff],"UNSUBSCRIBE: OK\r\n\r\n");
+	Unsubscribe();
+	return(1);
+	}
+
+	// attach a shared memory ring using the descriptors passed with the command
+	if (strcasecmp(querybuff,"SHMRING") == 0)
+	{
+	HandleShmring();
+	return(1);
+	}
+
+	// switch the connection to the binary protocol
+	if (strcasecmp(querybuff,"BINARY") == 0)
+	{
+	replyoff+=sprintf(&replybuff[replyoff],"BINARY: OK\r\n\r\n");
+	binarymode = 1;
+	return(1);
+	}
+
 	// stuff that starts with plus or minus is for log control
 	if ((querybuff[0] == '+') || (querybuff[0] == '-'))
 	{
@@ -148,49 +468,107 @@ if (strcasecmp(querybuff,"QUIT") == 0) 		{ return(0); }
 	return(1);
 	}
 
-hashcode = 0;
-local = NULL;
+	if (strncasecmp(querybuff,"LOOKUP|",7) == 0)
+	{
+	HandleLookup();
+	return(1);
+	}
 
-// client and server data will be passed to the classify message queue
-if (strncasecmp(querybuff,"CLIENT|",7) == 0) local = HandleChunk(MSG_CLIENT);
-if (strncasecmp(querybuff,"SERVER|",7) == 0) local = HandleChunk(MSG_SERVER);
-if (strncasecmp(querybuff,"PACKET|",7) == 0) local = HandleChunk(MSG_PACKET);
+	// client and server data will be passed to the classify message queue
+	// and the lookup reply is built once all of the chunk has arrived
+	if (strncasecmp(querybuff,"CLIENT|",7) == 0) return(HandleChunk(MSG_CLIENT));
+	if (strncasecmp(querybuff,"SERVER|",7) == 0) return(HandleChunk(MSG_SERVER));
+	if (strncasecmp(querybuff,"PACKET|",7) == 0) return(HandleChunk(MSG_PACKET));
+
+local = NULL;
+hashcode = 0;
 
 	// if we don't have a session yet then this is probably a console query
-	if ((local == NULL) && (g_mfwflag == 0))
+	if (g_mfwflag == 0)
 	{
 	hashcode = ExtractNetworkSession(querybuff);
 	local = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(hashcode));
 	}
 
+BuildLookupReply(local,hashcode,querybuff);
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+void NetworkClient::BuildLookupReply(SessionObject *local,u_int64_t hashcode,const char *argQuery)
+{
+char				namestr[256];
+
 	// if we have a hit return the found result
 	if (local != NULL)
 	{
 	LOGMESSAGE(CAT_CLIENT,LOG_DEBUG,"NETCLIENT FOUND = %s\n",local->GetObjectString(namestr,sizeof(namestr)));
+	BuildResultReply(hashcode,local->GetApplication(),local->GetProtochain(),local->GetDetail(),local->GetConfidence(),local->GetState());
+	return;
+	}
+
+LOGMESSAGE(CAT_CLIENT,LOG_DEBUG,"NETCLIENT EMPTY = %" PRIu64 "\n",hashcode);
+__sync_fetch_and_add(&client_misscount,1);
 
-	replyoff = 0;
-	replyoff+=sprintf(&replybuff[replyoff],"FOUND: %" PRIu64 "\r\n",hashcode);
-	replyoff+=sprintf(&replybuff[replyoff],"APPLICATION: %s\r\n",local->GetApplication());
-	replyoff+=sprintf(&replybuff[replyoff],"PROTOCHAIN: %s\r\n",local->GetProtochain());
-	replyoff+=sprintf(&replybuff[replyoff],"DETAIL: %s\r\n",local->GetDetail());
-	replyoff+=sprintf(&replybuff[replyoff],"CONFIDENCE: %d\r\n",local->GetConfidence());
-	replyoff+=sprintf(&replybuff[replyoff],"STATE: %d\r\n\r\n",local->GetState());
+	// otherwise return the empty result
+	if (binarymode != 0)
+	{
+	BuildBinaryReply(BIN_STATUS_EMPTY,hashcode,NULL,0);
+	return;
+	}
 
-	// if the wipeflag is set we have to delete the session
-	if (local->wipeflag != 0) delete(local);
+if (argQuery != NULL) replyoff+=sprintf(&replybuff[replyoff],"EMPTY: %s\r\n\r\n",argQuery);
+else replyoff+=sprintf(&replybuff[replyoff],"EMPTY: %" PRIu64 "\r\n\r\n",hashcode);
+}
+/*--------------------------------------------------------------------------*/
+void NetworkClient::BuildPacketReply(PacketResult *argResult)
+{
+const char			*application;
+char				protochain[256];
+int					value,x;
 
-	client_hitcount++;
+	// use the same names a new session starts with if
+	// vineyard didn't give us anything for the packet
+	if (argResult->application < 0)
+	{
+	application = (argResult->protocol == IPPROTO_IPV6 ? "IP6" : "IP");
+	sprintf(protochain,"/%s",application);
 	}
 
-	// otherwise return the empty result
+	// otherwise look up the names for the indexes saved by the callback
 	else
 	{
-	LOGMESSAGE(CAT_CLIENT,LOG_DEBUG,"NETCLIENT EMPTY = %" PRIu64 "\n",hashcode);
-	replyoff = sprintf(replybuff,"EMPTY: %s\r\n\r\n",querybuff);
-	client_misscount++;
+	application = g_protostats[argResult->application]->protocol_name;
+	protochain[0] = 0;
+
+		for(x = 0;x < argResult->chain_length;x++)
+		{
+		value = argResult->protochain[x];
+		strncat(protochain,"/",sizeof(protochain)-1);
+		strncat(protochain,(value >= g_protocount ? "???" : g_protostats[value]->protocol_name),sizeof(protochain)-1);
+		}
 	}
 
-return(1);
+LOGMESSAGE(CAT_CLIENT,LOG_DEBUG,"NETCLIENT PACKET = %" PRIu64 " [%d|%d|%s|%s|%s]\n",argResult->session,argResult->state,argResult->confidence,application,protochain,argResult->detail);
+BuildResultReply(argResult->session,application,protochain,argResult->detail,argResult->confidence,argResult->state);
+}
+/*--------------------------------------------------------------------------*/
+void NetworkClient::BuildResultReply(u_int64_t hashcode,const char *application,const char *protochain,const char *detail,int confidence,int state)
+{
+__sync_fetch_and_add(&client_hitcount,1);
+
+	// binary clients get the compact result
+	if (binarymode != 0)
+	{
+	BuildBinaryResult(hashcode,application,protochain,detail,confidence,state);
+	return;
+	}
+
+replyoff+=sprintf(&replybuff[replyoff],"FOUND: %" PRIu64 "\r\n",hashcode);
+replyoff+=sprintf(&replybuff[replyoff],"APPLICATION: %s\r\n",application);
+replyoff+=sprintf(&replybuff[replyoff],"PROTOCHAIN: %s\r\n",protochain);
+replyoff+=sprintf(&replybuff[replyoff],"DETAIL: %s\r\n",detail);
+replyoff+=sprintf(&replybuff[replyoff],"CONFIDENCE: %d\r\n",confidence);
+replyoff+=sprintf(&replybuff[replyoff],"STATE: %d\r\n\r\n",state);
 }
 /*--------------------------------------------------------------------------*/
 void NetworkClient::AdjustLogCategory(void)
@@ -200,7 +578,7 @@ int		found = 0;
 	if (strcasecmp(querybuff,"-LOGIC") == 0)
 	{
 	sysmessage(LOG_NOTICE,"Logic debug logging has been disabled\n");
-	replyoff = sprintf(replybuff,"%s","Logic debug logging been disabled\r\n\r\n");
+	replyoff+=sprintf(&replybuff[replyoff],"%s","Logic debug logging been disabled\r\n\r\n");
 	g_debug&=~CAT_LOGIC;
 	found++;
 	}
@@ -208,7 +586,7 @@ int		found = 0;
 	if (strcasecmp(querybuff,"+LOGIC") == 0)
 	{
 	sysmessage(LOG_NOTICE,"Logic debug logging has been enabled\n");
-	replyoff = sprintf(replybuff,"%s","Logic debug logging has been enabled\r\n\r\n");
+	replyoff+=sprintf(&replybuff[replyoff],"%s","Logic debug logging has been enabled\r\n\r\n");
 	g_debug|=CAT_LOGIC;
 	found++;
 	}
@@ -216,7 +594,7 @@ int		found = 0;
 	if (strcasecmp(querybuff,"-CLIENT") == 0)
 	{
 	sysmessage(LOG_NOTICE,"Client debug logging has been disabled\n");
-	replyoff = sprintf(replybuff,"%s","Client debug logging been disabled\r\n\r\n");
+	replyoff+=sprintf(&replybuff[replyoff],"%s","Client debug logging been disabled\r\n\r\n");
 	g_debug&=~CAT_CLIENT;
 	found++;
 	}
@@ -224,7 +602,7 @@ int		found = 0;
 	if (strcasecmp(querybuff,"+CLIENT") == 0)
 	{
 	sysmessage(LOG_NOTICE,"Client debug logging has been enabled\n");
-	replyoff = sprintf(replybuff,"%s","Client debug logging has been enabled\r\n\r\n");
+	replyoff+=sprintf(&replybuff[replyoff],"%s","Client debug logging has been enabled\r\n\r\n");
 	g_debug|=CAT_CLIENT;
 	found++;
 	}
@@ -232,7 +610,7 @@ int		found = 0;
 	if (strcasecmp(querybuff,"-UPDATE") == 0)
 	{
 	sysmessage(LOG_NOTICE,"Update debug logging has been disabled\n");
-	replyoff = sprintf(replybuff,"%s","Update debug logging been disabled\r\n\r\n");
+	replyoff+=sprintf(&replybuff[replyoff],"%s","Update debug logging been disabled\r\n\r\n");
 	g_debug&=~CAT_UPDATE;
 	found++;
 	}
@@ -240,7 +618,7 @@ int		found = 0;
 	if (strcasecmp(querybuff,"+UPDATE") == 0)
 	{
 	sysmessage(LOG_NOTICE,"Update debug logging has been enabled\n");
-	replyoff = sprintf(replybuff,"%s","Update debug logging has been enabled\r\n\r\n");
+	replyoff+=sprintf(&replybuff[replyoff],"%s","Update debug logging has been enabled\r\n\r\n");
 	g_debug|=CAT_UPDATE;
 	found++;
 	}
@@ -248,7 +626,7 @@ int		found = 0;
 	if (strcasecmp(querybuff,"-VINEYARD") == 0)
 	{
 	sysmessage(LOG_NOTICE,"Vineyard debug logging has been disabled\n");
-	replyoff = sprintf(replybuff,"%s","Packet debug logging been disabled\r\n\r\n");
+	replyoff+=sprintf(&replybuff[replyoff],"%s","Packet debug logging been disabled\r\n\r\n");
 	g_debug&=~CAT_VINEYARD;
 	found++;
 	}
@@ -256,7 +634,7 @@ int		found = 0;
 	if (strcasecmp(querybuff,"+VINEYARD") == 0)
 	{
 	sysmessage(LOG_NOTICE,"Vineyard debug logging has been enabled\n");
-	replyoff = sprintf(replybuff,"%s","Packet debug logging has been enabled\r\n\r\n");
+	replyoff+=sprintf(&replybuff[replyoff],"%s","Packet debug logging has been enabled\r\n\r\n");
 	g_debug|=CAT_VINEYARD;
 	found++;
 	}
@@ -264,7 +642,7 @@ int		found = 0;
 	if (strcasecmp(querybuff,"-SESSION") == 0)
 	{
 	sysmessage(LOG_NOTICE,"Session debug logging has been disabled\n");
-	replyoff = sprintf(replybuff,"%s","Session debug logging been disabled\r\n\r\n");
+	replyoff+=sprintf(&replybuff[replyoff],"%s","Session debug logging been disabled\r\n\r\n");
 	g_debug&=~CAT_SESSION;
 	found++;
 	}
@@ -272,22 +650,22 @@ int		found = 0;
 	if (strcasecmp(querybuff,"+SESSION") == 0)
 	{
 	sysmessage(LOG_NOTICE,"Session debug logging has been enabled\n");
-	replyoff = sprintf(replybuff,"%s","Session debug logging has been enabled\r\n\r\n");
+	replyoff+=sprintf(&replybuff[replyoff],"%s","Session debug logging has been enabled\r\n\r\n");
 	g_debug|=CAT_SESSION;
 	found++;
 	}
 
 if (found != 0) return;
-replyoff = sprintf(replybuff,"%s","Unrecognized log control command\r\n\r\n");
+replyoff+=sprintf(&replybuff[replyoff],"%s","Unrecognized log control command\r\n\r\n");
 }
 /*--------------------------------------------------------------------------*/
 void NetworkClient::HandleCreate(void)
 {
-SessionObject		*session;
 char				*aa,*bb,*cc,*dd,*ee,*ff;
 navl_host_t			client,server;
 u_int64_t			hashcode;
 u_int16_t			protocol;
+int					ret;
 
 // first we extract the connection details from the message
 
@@ -382,56 +760,190 @@ memset(&server,0,sizeof(server));
 	}
 
 // insert the new session object in the hashtable
-session = new SessionObject(hashcode,protocol,&client,&server);
-g_sessiontable->InsertObject(session);
+ret = CreateSession(hashcode,protocol,&client,&server);
 
-	// for TCP and UDP post the create message to the classify thread
-	// so the navl connection state handle can be initialized
-	if ((protocol == IPPROTO_TCP) || (protocol == IPPROTO_UDP))
+	if (ret == 0)
 	{
-	g_messagequeue->PushMessage(new MessageWagon(MSG_CREATE,hashcode));
+	if (quietflag == 0) replyoff+=sprintf(&replybuff[replyoff],"FAILED: %" PRIu64 "\r\n\r\n",hashcode);
+	return;
 	}
 
 // have to return something even though the node currently does not use it
-replyoff = sprintf(replybuff,"CREATED: %" PRIu64 "\r\n\r\n",hashcode);
+if (quietflag == 0) replyoff+=sprintf(&replybuff[replyoff],"CREATED: %" PRIu64 "\r\n\r\n",hashcode);
+}
+/*--------------------------------------------------------------------------*/
+void NetworkClient::HandleShmring(void)
+{
+PacketRing		*local;
+
+	// the ring feeds the classify threads so it only works on NGFW and
+	// we need both the memfd and eventfd passed with the command
+	if ((g_mfwflag != 0) || (packetring != NULL) || (passcount != 2))
+	{
+	replyoff+=sprintf(&replybuff[replyoff],"SHMRING: INVALID\r\n\r\n");
+	DiscardPassed();
+	return;
+	}
+
+	try
+	{
+	local = new PacketRing(passfd[0],passfd[1],netname);
+	}
+
+	catch(Problem *err)
+	{
+	if (err->string != NULL) sysmessage(LOG_WARNING,"%s CODE:%d\n",err->string,err->value);
+	delete(err);
+	replyoff+=sprintf(&replybuff[replyoff],"SHMRING: INVALID\r\n\r\n");
+	DiscardPassed();
+	return;
+	}
+
+// the ring now owns the descriptors
+passfd[0] = -1;
+passfd[1] = -1;
+passcount = 0;
+
+packetring = local;
+packetring->BeginExecution();
+
+replyoff+=sprintf(&replybuff[replyoff],"SHMRING: OK\r\n\r\n");
 }
 /*--------------------------------------------------------------------------*/
 void NetworkClient::HandleRemove(void)
 {
-SessionObject	*session;
 u_int64_t		hashcode;
 char			*aa;
+int				ret;
 
 aa = strchr(querybuff,'|');		// points to session id
 if (aa == NULL) return;
 *aa++=0;
 hashcode = ExtractNetworkSession(aa);
 
-session = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(hashcode));
+ret = RemoveSession(hashcode);
+
+// nothing else to do when the client doesn't want a reply
+if (quietflag != 0) return;
 
 	// if we can't find the session return an invalid response
-	if (session == NULL)
+	if (ret == 0)
 	{
-	replyoff = sprintf(replybuff,"INVALID: %" PRIu64 "\r\n\r\n",hashcode);
+	replyoff+=sprintf(&replybuff[replyoff],"INVALID: %" PRIu64 "\r\n\r\n",hashcode);
 	return;
 	}
 
-// the classify thread handles all session removes so it can do navl cleanup
-g_messagequeue->PushMessage(new MessageWagon(MSG_REMOVE,hashcode));
-
 // have to return something even though the node currently does not use it
-replyoff = sprintf(replybuff,"REMOVED: %" PRIu64 "\r\n\r\n",hashcode);
+replyoff+=sprintf(&replybuff[replyoff],"REMOVED: %" PRIu64 "\r\n\r\n",hashcode);
 }
 /*--------------------------------------------------------------------------*/
-SessionObject* NetworkClient::HandleChunk(u_int8_t argMessage)
+void NetworkClient::HandleLookup(void)
 {
 SessionObject	*local;
-struct timeval	tv;
 u_int64_t		hashcode;
-fd_set			tester;
+char			*aa;
+int				count;
+
+// The batch lookup includes up to LOOKUP_MAXIMUM session ids and we return
+// one line for each in the same order.  The detail is last since it can
+// contain anything including our separator character.
+//
+// LOOKUP|SESSIONID|SESSIONID|...
+//
+// LOOKUP: COUNT
+// SESSIONID|APPLICATION|PROTOCHAIN|CONFIDENCE|STATE|DETAIL
+// SESSIONID|EMPTY
+
+// count the session ids so we can reserve space for the reply
+count = 0;
+for(aa = strchr(querybuff,'|');aa != NULL;aa = strchr(aa + 1,'|')) count++;
+
+	// limit the batch size so a client can't make us reserve a huge reply
+	if (count > LOOKUP_MAXIMUM)
+	{
+	replyoff+=sprintf(&replybuff[replyoff],"LOOKUP: INVALID\r\n\r\n");
+	return;
+	}
+
+ReserveReply((count * (32 + 16 + 256 + 16 + 256)) + 64);
+replyoff+=sprintf(&replybuff[replyoff],"LOOKUP: %d\r\n",count);
+
+	for(aa = strchr(querybuff,'|');aa != NULL;aa = strchr(aa,'|'))
+	{
+	aa++;
+	hashcode = ExtractNetworkSession(aa);
+
+	local = NULL;
+	if (g_mfwflag == 0) local = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(hashcode));
+
+		if (local == NULL)
+		{
+		replyoff+=sprintf(&replybuff[replyoff],"%" PRIu64 "|EMPTY\r\n",hashcode);
+		__sync_fetch_and_add(&client_misscount,1);
+		continue;
+		}
+
+	replyoff+=sprintf(&replybuff[replyoff],"%" PRIu64 "|%s|%s|%d|%d|%s\r\n",hashcode,
+		local->GetApplication(),local->GetProtochain(),local->GetConfidence(),local->GetState(),local->GetDetail());
+
+	__sync_fetch_and_add(&client_hitcount,1);
+	}
+
+replyoff+=sprintf(&replybuff[replyoff],"\r\n");
+}
+/*--------------------------------------------------------------------------*/
+int NetworkClient::CreateSession(u_int64_t hashcode,u_int16_t protocol,navl_host_t *client,navl_host_t *server)
+{
+SessionObject		*session;
+
+	// the session pool throws when it can't get any more memory and
+	// we drop the session rather than let it take down the thread
+	try
+	{
+	session = new SessionObject(hashcode,protocol,client,server);
+	}
+
+	catch(std::bad_alloc &err)
+	{
+	sysmessage(LOG_ERR,"Unable to allocate memory for session %" PRIu64 "\n",hashcode);
+	__sync_fetch_and_add(&session_dropcount,1);
+	return(0);
+	}
+
+// insert the new session object in the hashtable
+g_sessiontable->InsertObject(session);
+
+// start the timer that will remove the session once it goes stale
+g_timerwheel->InsertTimer(session);
+
+	// for TCP and UDP post the create message to the classify thread
+	// so the navl connection state handle can be initialized
+	if ((protocol == IPPROTO_TCP) || (protocol == IPPROTO_UDP))
+	{
+	classify_dispatch(new MessageWagon(MSG_CREATE,hashcode));
+	}
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int NetworkClient::RemoveSession(u_int64_t hashcode)
+{
+SessionObject	*session;
+
+session = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(hashcode));
+if (session == NULL) return(0);
+
+// the classify thread handles all session removes so it can do navl cleanup
+classify_dispatch(new MessageWagon(MSG_REMOVE,hashcode));
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int NetworkClient::HandleChunk(u_int8_t argMessage)
+{
+u_int64_t		hashcode;
 int				rawproto;
 char			*aa,*bb,*cc;
-long			length,ret;
+long			length;
 
 // We receive data to classify from the NGFW code with a simple text header
 // that includes the source, session, and length followed by the raw data.
@@ -446,94 +958,508 @@ long			length,ret;
 // SERVER|95324669281375|370
 // PACKET|95324669281375|IP4|627
 
+// without a length there is no chunk data to receive so anything
+// malformed just gets an empty lookup result
+
 aa = strchr(querybuff,'|');		// points to session id
-if (aa == NULL) return(NULL);
+	if (aa == NULL)
+	{
+	if (quietflag == 0) BuildLookupReply(NULL,0,querybuff);
+	return(1);
+	}
 *aa++=0;
 hashcode = ExtractNetworkSession(aa);
 
 bb = strchr(aa,'|');			// points to next field
-if (bb == NULL) return(NULL);
+	if (bb == NULL)
+	{
+	if (quietflag == 0) BuildLookupReply(NULL,0,querybuff);
+	return(1);
+	}
 *bb++=0;
 
-	// under NGFW we find the session in the table
+	// under NGFW we only need the length since the session is
+	// found in the table after we have received all the data
 	if (g_mfwflag == 0)
 	{
 	length = strtol(bb,NULL,10);
-	local = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(hashcode));
+	rawproto = 0;
 	}
 
-	// under MFW we create a session object and set the special wipe flag
+	// under MFW we also need the raw protocol for the session
 	else
 	{
 	rawproto = 9999;
 	if (strncmp(bb,"IP4",3) == 0) rawproto = IPPROTO_IP;
 	if (strncmp(bb,"IP6",3) == 0) rawproto = IPPROTO_IPV6;
-	if (rawproto == 9999) return(NULL);
+		if (rawproto == 9999)
+		{
+		if (quietflag == 0) BuildLookupReply(NULL,0,querybuff);
+		return(1);
+		}
 
 	cc = strchr(bb,'|');
-	if (cc == NULL) return(NULL);
+		if (cc == NULL)
+		{
+		if (quietflag == 0) BuildLookupReply(NULL,0,querybuff);
+		return(1);
+		}
 	*cc++=0;
 	length = strtol(cc,NULL,10);
+	}
+
+return(BeginChunk(argMessage,hashcode,rawproto,length));
+}
+/*--------------------------------------------------------------------------*/
+int NetworkClient::BeginChunk(u_int8_t argMessage,u_int64_t hashcode,int rawproto,long length)
+{
+long			count;
 
-	local = new SessionObject(hashcode,rawproto,NULL,NULL);
-	local->wipeflag = 1;
+	// we can't trust anything that follows a garbage length so
+	// return zero to have the server thread drop the client
+	if ((length < 0) || (length > CHUNK_MAXIMUM))
+	{
+	sysmessage(LOG_WARNING,"Invalid chunk length %ld from netclient %s\n",length,netname);
+	return(0);
 	}
 
-// prepare to receive the chunk of data
-replyoff = 0;
+	// under MFW we reset the client packet result that the vineyard
+	// callbacks fill in since there is no session object to update
+	if (g_mfwflag != 0)
+	{
+	chunkresult.session = hashcode;
+	chunkresult.protocol = rawproto;
+	chunkresult.confidence = 0;
+	chunkresult.state = NAVL_STATE_INSPECTING;
+	chunkresult.application = -1;
+	chunkresult.chain_length = 0;
+	chunkresult.detail[0] = 0;
+	}
+
+// allocate a wagon with enough inline space to hold the entire chunk
+// so we can receive the data directly into the buffer that gets
+// passed to the classify thread without making another copy
+chunkwagon = new(length) MessageWagon(argMessage,hashcode,length);
+chunkoff = 0;
 
 	// if there is chunk data in the query buffer we grab it first
+	// and adjust the query buffer counters to show we consumed it
 	if (datalen != 0)
 	{
-	memcpy(replybuff,&querybuff[dataloc],datalen);
-	replyoff = datalen;
+	count = (datalen > length ? length : datalen);
+	memcpy(chunkwagon->buffer,&querybuff[dataloc],count);
+	chunkoff = count;
+	dataloc+=count;
+	datalen-=count;
+	}
+
+// if we already have everything handle the chunk now otherwise the
+// rest will be received by the network handler as it arrives
+if (chunkoff == length) CompleteChunk();
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+void NetworkClient::CompleteChunk(void)
+{
+MessageWagon	*wagon;
+SessionObject	*local;
+u_int64_t		hashcode;
+
+// make sure there is plenty of room to append the reply
+ReserveReply(REPLY_MINIMUM);
+
+// clear the chunk state since we now own the wagon
+wagon = chunkwagon;
+hashcode = wagon->index;
+chunkwagon = NULL;
+chunkoff = 0;
+
+	// when running on MFW we do the classification inline and
+	// the reply is built from the client packet result
+	if (g_mfwflag != 0)
+	{
+	vineyard_classify(&chunkresult,(char *)wagon->buffer,wagon->length);
+	delete(wagon);
+	if (quietflag == 0) BuildPacketReply(&chunkresult);
+	return;
+	}
+
+// for NGFW we push the wagon into the classify queue
+classify_dispatch(wagon);
+
+// when the client doesn't want a reply we're finished
+if (quietflag != 0) return;
+
+// find the session to build the lookup reply
+local = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(hashcode));
+BuildLookupReply(local,hashcode,NULL);
+}
+/*--------------------------------------------------------------------------*/
+int NetworkClient::ProcessBinary(void)
+{
+BinaryHeader	header;
+BinaryCreate	create;
+navl_host_t		client,server;
+SessionObject	*local;
+u_int64_t		hashcode;
+int				status,count,ret,x;
+
+// wait until we have the complete header
+if (queryoff < (int)sizeof(header)) return(1);
+memcpy(&header,querybuff,sizeof(header));
+
+// set dataloc and datalen to the payload following the header
+dataloc = sizeof(header);
+datalen = (queryoff - dataloc);
+binaryopcode = header.opcode;
+
+// the client can disable the reply for the connection or for each request
+quietflag = ((noreply != 0) || (header.flags & BIN_FLAG_NOREPLY));
+
+	// chunk data is received directly into the wagon so we
+	// don't need to have the payload in the query buffer
+	switch(header.opcode)
+	{
+	case BIN_CLIENT:
+		ret = BeginChunk(MSG_CLIENT,header.session,0,header.length);
+		return(ret == 0 ? 0 : 2);
+	case BIN_SERVER:
+		ret = BeginChunk(MSG_SERVER,header.session,0,header.length);
+		return(ret == 0 ? 0 : 2);
+	case BIN_PACKET:
+		ret = BeginChunk(MSG_PACKET,header.session,header.param,header.length);
+		return(ret == 0 ? 0 : 2);
 	}
 
-	// we read the chunk data into the reply buffer since it is larger
-	while (replyoff < length)
+	// everything else must fit in the query buffer
+	if (GrowQuery(sizeof(header) + header.length + 1) == 0)
 	{
-	if (g_shutdown != 0) break;
+	sysmessage(LOG_WARNING,"Invalid binary length %u from netclient %s\n",header.length,netname);
+	return(0);
+	}
 
-	// clear our set and add the client socket
-	FD_ZERO(&tester);
-	FD_SET(netsock,&tester);
+// wait until we have the complete payload
+if (datalen < (int)header.length) return(1);
 
-	// wait for the socket to be ready for reading
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
-	ret = select(netsock+1,&tester,NULL,NULL,&tv);
-	if (ret < 1) continue;
-	if (FD_ISSET(netsock,&tester) == 0) continue;
+// consume the payload from the query buffer
+dataloc+=header.length;
+datalen-=header.length;
 
-	// read from the socket
-	ret = recv(netsock,&replybuff[replyoff],length - replyoff,0);
+	switch(header.opcode)
+	{
+	case BIN_CREATE:
+		if (header.length != sizeof(create)) return(0);
+		memcpy(&create,&querybuff[sizeof(header)],sizeof(create));
 
-		if (ret == 0)
+		// the session table only exists on NGFW
+		if (g_mfwflag != 0)
 		{
-		sysmessage(LOG_WARNING,"Unexpected netclient disconnect reading from %s\n",netname);
-		return(local);
+		if (quietflag == 0) BuildBinaryReply(BIN_STATUS_ERROR,header.session,NULL,0);
+		break;
 		}
 
-		if (ret < 0)
+		// clean the client and server host objects
+		memset(&client,0,sizeof(client));
+		memset(&server,0,sizeof(server));
+
+		// the addresses and ports are already in network order
+		client.family = (create.family == 6 ? NAVL_AF_INET6 : NAVL_AF_INET);
+		server.family = client.family;
+		client.port = create.client_port;
+		server.port = create.server_port;
+
+		if (create.family == 6)
+		{
+		memcpy(&client.in6_addr,create.client_addr,16);
+		memcpy(&server.in6_addr,create.server_addr,16);
+		} else {
+		memcpy(&client.in4_addr,create.client_addr,4);
+		memcpy(&server.in4_addr,create.server_addr,4);
+		}
+
+		ret = CreateSession(header.session,create.protocol,&client,&server);
+		status = (ret == 0 ? BIN_STATUS_ERROR : BIN_STATUS_OK);
+		if (quietflag == 0) BuildBinaryReply(status,header.session,NULL,0);
+		break;
+
+	case BIN_REMOVE:
+		// the session table only exists on NGFW
+		if (g_mfwflag != 0)
 		{
-		sysmessage(LOG_WARNING,"Error %d reading from netclient %s\n",ret,netname);
-		return(local);
+		if (quietflag == 0) BuildBinaryReply(BIN_STATUS_ERROR,header.session,NULL,0);
+		break;
 		}
 
-	// add the byte count we just received to the buffer offset
-	replyoff = (replyoff + ret);
+		ret = RemoveSession(header.session);
+		status = (ret == 0 ? BIN_STATUS_INVALID : BIN_STATUS_OK);
+		if (quietflag == 0) BuildBinaryReply(status,header.session,NULL,0);
+		break;
+
+	case BIN_LOOKUP:
+		local = NULL;
+		if (g_mfwflag == 0) local = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(header.session));
+		BuildLookupReply(local,header.session,NULL);
+		break;
+
+	case BIN_SUBSCRIBE:
+		if (header.param != 0) Subscribe();
+		else Unsubscribe();
+		BuildBinaryReply(BIN_STATUS_OK,0,NULL,0);
+		break;
+
+	// the payload is an array of session ids and we return a normal
+	// lookup reply for each one in the same order
+	case BIN_LOOKUP_BATCH:
+		count = (header.length / sizeof(u_int64_t));
+
+			// limit the batch size the same as the text protocol
+			if (count > LOOKUP_MAXIMUM)
+			{
+			BuildBinaryReply(BIN_STATUS_INVALID,0,NULL,0);
+			break;
+			}
+
+		ReserveReply(count * (sizeof(BinaryHeader) + sizeof(BinaryResult) + 16 + 256 + 256));
+		binaryopcode = BIN_LOOKUP;
+
+			for(x = 0;x < count;x++)
+			{
+			memcpy(&hashcode,&querybuff[sizeof(header) + (x * sizeof(u_int64_t))],sizeof(hashcode));
+			local = NULL;
+			if (g_mfwflag == 0) local = dynamic_cast<SessionObject*>(g_sessiontable->SearchObject(hashcode));
+			BuildLookupReply(local,hashcode,NULL);
+			}
+		break;
+
+	default:
+		sysmessage(LOG_WARNING,"Invalid binary opcode %d from netclient %s\n",header.opcode,netname);
+		return(0);
 	}
 
-	// when running on MFW we do the classification inline
-	if (g_mfwflag != 0)
+return(2);
+}
+/*--------------------------------------------------------------------------*/
+void NetworkClient::BuildBinaryReply(int argStatus,u_int64_t argSession,const void *argPayload,int argLength)
+{
+BinaryHeader	header;
+
+// the reply echoes the request opcode with the reply bit set and
+// uses the param field to pass the status back to the client
+memset(&header,0,sizeof(header));
+header.opcode = (binaryopcode | BIN_REPLY);
+header.param = argStatus;
+header.length = argLength;
+header.session = argSession;
+
+memcpy(&replybuff[replyoff],&header,sizeof(header));
+replyoff+=sizeof(header);
+
+if (argLength == 0) return;
+memcpy(&replybuff[replyoff],argPayload,argLength);
+replyoff+=argLength;
+}
+/*--------------------------------------------------------------------------*/
+void NetworkClient::BuildBinaryResult(u_int64_t hashcode,const char *application,const char *protochain,const char *detail,int confidence,int state)
+{
+BinaryResult	result;
+char			work[sizeof(result) + 16 + 256 + 256];
+int				size;
+
+// the result is followed by the strings without null terminators
+memset(&result,0,sizeof(result));
+result.state = state;
+result.confidence = confidence;
+result.application_length = strlen(application);
+result.protochain_length = strlen(protochain);
+result.detail_length = strlen(detail);
+
+memcpy(work,&result,sizeof(result));
+size = sizeof(result);
+memcpy(&work[size],application,result.application_length);
+size+=result.application_length;
+memcpy(&work[size],protochain,result.protochain_length);
+size+=result.protochain_length;
+memcpy(&work[size],detail,result.detail_length);
+size+=result.detail_length;
+
+BuildBinaryReply(BIN_STATUS_OK,hashcode,work,size);
+}
+/*--------------------------------------------------------------------------*/
+void NetworkClient::Subscribe(void)
+{
+if (subscribed != 0) return;
+
+// add ourselves to the list of subscribers
+pthread_mutex_lock(&l_event_lock);
+nextsub = l_subscriber_list;
+l_subscriber_list = this;
+subscribed = 1;
+__sync_fetch_and_add(&g_subscriber_count,1);
+pthread_mutex_unlock(&l_event_lock);
+}
+/*--------------------------------------------------------------------------*/
+void NetworkClient::Unsubscribe(void)
+{
+NetworkClient	*work,*prev;
+SessionEvent	*event;
+
+if (subscribed == 0) return;
+
+pthread_mutex_lock(&l_event_lock);
+
+	// pull ourselves out of the list of subscribers
+	for(prev = NULL,work = l_subscriber_list;work != NULL;prev = work,work = work->nextsub)
+	{
+	if (work != this) continue;
+	if (prev == NULL) l_subscriber_list = work->nextsub;
+	else prev->nextsub = work->nextsub;
+	break;
+	}
+
+subscribed = 0;
+__sync_fetch_and_sub(&g_subscriber_count,1);
+
+	// discard any events that were never delivered
+	while (eventhead != NULL)
+	{
+	event = eventhead;
+	eventhead = event->next;
+	free(event);
+	}
+
+eventtail = NULL;
+eventcount = 0;
+
+pthread_mutex_unlock(&l_event_lock);
+}
+/*--------------------------------------------------------------------------*/
+void NetworkClient::PublishEvent(SessionObject *aSession)
+{
+NetworkClient	*work;
+SessionEvent	*event;
+u_int64_t		value;
+int				ret;
+
+pthread_mutex_lock(&l_event_lock);
+
+	// give every subscriber a copy of the event and wake up the
+	// network server thread that owns the client to deliver it
+	for(work = l_subscriber_list;work != NULL;work = work->nextsub)
+	{
+		// drop events for clients that aren't keeping up
+		if (work->eventcount >= EVENT_MAXIMUM)
+		{
+		event_dropcount++;
+		continue;
+		}
+
+	event = (SessionEvent *)malloc(sizeof(SessionEvent));
+	event->next = NULL;
+	event->session = aSession->GetNetSession();
+	event->confidence = aSession->GetConfidence();
+	event->state = aSession->GetState();
+	strncpy(event->application,aSession->GetApplication(),sizeof(event->application));
+	event->application[sizeof(event->application) - 1] = 0;
+	strncpy(event->protochain,aSession->GetProtochain(),sizeof(event->protochain));
+	event->protochain[sizeof(event->protochain) - 1] = 0;
+	strncpy(event->detail,aSession->GetDetail(),sizeof(event->detail));
+	event->detail[sizeof(event->detail) - 1] = 0;
+
+	if (work->eventtail == NULL) work->eventhead = event;
+	else work->eventtail->next = event;
+	work->eventtail = event;
+	work->eventcount++;
+
+	value = 1;
+	ret = write(work->eventsock,&value,sizeof(value));
+	if (ret != sizeof(value)) continue;
+	}
+
+pthread_mutex_unlock(&l_event_lock);
+
+__sync_fetch_and_add(&event_totalcount,1);
+}
+/*--------------------------------------------------------------------------*/
+NetworkClient* NetworkClient::GrabEvents(int aEventsock)
+{
+NetworkClient	*work,*list;
+
+list = NULL;
+
+pthread_mutex_lock(&l_event_lock);
+
+	// detach the pending events for all subscribers that
+	// belong to the network server that owns the eventfd
+	for(work = l_subscriber_list;work != NULL;work = work->nextsub)
+	{
+	if (work->eventsock != aEventsock) continue;
+	if (work->eventhead == NULL) continue;
+
+	work->eventready = work->eventhead;
+	work->eventhead = work->eventtail = NULL;
+	work->eventcount = 0;
+	work->nextready = list;
+	list = work;
+	}
+
+pthread_mutex_unlock(&l_event_lock);
+
+return(list);
+}
+/*--------------------------------------------------------------------------*/
+void NetworkClient::FormatEvents(void)
+{
+SessionEvent	*event;
+BinaryResult	result;
+char			work[sizeof(result) + 16 + 256 + 256];
+int				opcode,size;
+
+// Events can be sent while a binary chunk is still being received so we
+// save the opcode of the request and put it back for the chunk reply.
+opcode = binaryopcode;
+
+	while (eventready != NULL)
 	{
-	vineyard_classify(local,replybuff,replyoff);
-	return(local);
+	event = eventready;
+	eventready = event->next;
+
+	ReserveReply(sizeof(BinaryHeader) + sizeof(work) + 64);
+
+		// text clients get a line that looks like a batch lookup result
+		if (binarymode == 0)
+		{
+		replyoff+=sprintf(&replybuff[replyoff],"EVENT: %" PRIu64 "|%s|%s|%d|%d|%s\r\n\r\n",event->session,
+			event->application,event->protochain,event->confidence,event->state,event->detail);
+		}
+
+		// binary clients get the same payload as a lookup result
+		else
+		{
+		memset(&result,0,sizeof(result));
+		result.state = event->state;
+		result.confidence = event->confidence;
+		result.application_length = strlen(event->application);
+		result.protochain_length = strlen(event->protochain);
+		result.detail_length = strlen(event->detail);
+
+		memcpy(work,&result,sizeof(result));
+		size = sizeof(result);
+		memcpy(&work[size],event->application,result.application_length);
+		size+=result.application_length;
+		memcpy(&work[size],event->protochain,result.protochain_length);
+		size+=result.protochain_length;
+		memcpy(&work[size],event->detail,result.detail_length);
+		size+=result.detail_length;
+
+		binaryopcode = BIN_EVENT;
+		BuildBinaryReply(BIN_STATUS_OK,event->session,work,size);
+		}
+
+	free(event);
 	}
 
-// for NGFW we push the data into the classify queue
-g_messagequeue->PushMessage(new MessageWagon(argMessage,hashcode,replybuff,replyoff));
-return(local);
+binaryopcode = opcode;
 }
 /*--------------------------------------------------------------------------*/
 u_int64_t NetworkClient::ExtractNetworkSession(const char *argBuffer)
@@ -551,51 +1477,80 @@ return(hashcode);
 /*--------------------------------------------------------------------------*/
 int NetworkClient::TransmitReply(void)
 {
-struct timeval	tv;
-fd_set			tester;
-int				offset,ret;
-
-offset = 0;
+int				ret,size;
 
-	while (offset != replyoff)
+	// send as much of the reply as the socket will take and leave
+	// the rest for when the server thread sees the socket is writable
+	while (replysent != replyoff)
 	{
-	if (g_shutdown != 0) break;
-
-	// clear our set and add the client socket
-	FD_ZERO(&tester);
-	FD_SET(netsock,&tester);
+	// packet sockets send each call as a single record so we limit
+	// the size to keep large replies below the socket buffer size
+	size = (replyoff - replysent);
+	if ((packetmode != 0) && (size > REPLY_BACKLOG)) size = REPLY_BACKLOG;
 
-	// wait for the socket to be ready for writing
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
-	ret = select(netsock+1,NULL,&tester,NULL,&tv);
-	if (ret < 1) continue;
-	if (FD_ISSET(netsock,&tester) == 0) continue;
-
-	// write to the socket
-	ret = send(netsock,&replybuff[offset],replyoff - offset,0);
+	ret = send(netsock,&replybuff[replysent],size,0);
 
 		// check for errors
 		if (ret == -1)
 		{
-		if (errno == EWOULDBLOCK) continue;
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return(1);
+		if (errno == EINTR) continue;
 		sysmessage(LOG_ERR,"Error %d returned from send(%s)\n",errno,netname);
 		return(0);
 		}
 
 	// add the size just sent to the total transmitted
-	offset+=ret;
+	replysent+=ret;
 	}
 
+// the whole reply was sent so clear the reply buffer
+replybuff[0] = 0;
+replyoff = 0;
+replysent = 0;
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int NetworkClient::GrowQuery(int argSize)
+{
+// nothing to do if the buffer is already large enough
+if (argSize <= querysize) return(1);
+
+// we don't allow the buffer to grow beyond the limit
+if (argSize > QUERY_MAXIMUM) return(0);
+
+querybuff = (char *)realloc(querybuff,argSize);
+querysize = argSize;
 return(1);
 }
 /*--------------------------------------------------------------------------*/
+void NetworkClient::ReserveReply(int argSize)
+{
+int		size;
+
+// nothing to do if there is already enough room
+if ((replyoff + argSize) < replysize) return;
+
+// otherwise grow the buffer to hold at least the requested size
+size = (replysize * 2);
+if (size <= (replyoff + argSize)) size = (replyoff + argSize + 1);
+replybuff = (char *)realloc(replybuff,size);
+replysize = size;
+}
+/*--------------------------------------------------------------------------*/
 void NetworkClient::BuildDebugInfo(void)
 {
+u_int64_t	hits,misses;
+u_int64_t	epoch,freed,expired;
+double		load;
 char		temp[64];
+int			histogram[TABLE_HISTOGRAM];
+int			slabhist[SLAB_HISTOGRAM];
 int			count,bytes,hicnt,himem;
+int			c,b,hc,hm,x;
+int			idle,pending;
 
-replyoff = sprintf(replybuff,"========== CLASSD DEBUG INFO ==========\r\n");
+replyoff+=sprintf(&replybuff[replyoff],"========== CLASSD DEBUG INFO ==========\r\n");
 replyoff+=sprintf(&replybuff[replyoff],"  Current Time .................... %s\r\n",nowtimestr(temp));
 replyoff+=sprintf(&replybuff[replyoff],"  Run Time ........................ %s\r\n",runtimestr(temp));
 replyoff+=sprintf(&replybuff[replyoff],"  Version ......................... %s\r\n",VERSION);
@@ -606,16 +1561,69 @@ replyoff+=sprintf(&replybuff[replyoff],"  No Fork Flag .................... %d\r
 replyoff+=sprintf(&replybuff[replyoff],"  No Limit Flag ................... %d\r\n",g_nolimit);
 replyoff+=sprintf(&replybuff[replyoff],"  Console Flag .................... %d\r\n",g_console);
 replyoff+=sprintf(&replybuff[replyoff],"  MFW Flag ........................ %d\r\n",g_mfwflag);
+replyoff+=sprintf(&replybuff[replyoff],"  Network Thread Count ............ %s\r\n",pad(temp,g_netserver_count));
 replyoff+=sprintf(&replybuff[replyoff],"  Client Hit Count ................ %s\r\n",pad(temp,client_hitcount));
 replyoff+=sprintf(&replybuff[replyoff],"  Client Miss Count ............... %s\r\n",pad(temp,client_misscount));
+replyoff+=sprintf(&replybuff[replyoff],"  Event Subscriber Count .......... %s\r\n",pad(temp,g_subscriber_count));
+replyoff+=sprintf(&replybuff[replyoff],"  Event Total Count ............... %s\r\n",pad(temp,event_totalcount));
+replyoff+=sprintf(&replybuff[replyoff],"  Event Drop Count ................ %s\r\n",pad(temp,event_dropcount));
+replyoff+=sprintf(&replybuff[replyoff],"  Ring Chunk Count ................ %s\r\n",pad(temp,ring_totalcount));
+replyoff+=sprintf(&replybuff[replyoff],"  Ring Error Count ................ %s\r\n",pad(temp,ring_errorcount));
+replyoff+=sprintf(&replybuff[replyoff],"  Result Table Drop Count ......... %s\r\n",pad(temp,result_dropcount));
+
+g_epochmanager->GetEpochStats(epoch,pending,freed);
+replyoff+=sprintf(&replybuff[replyoff],"  Epoch Current ................... %s\r\n",pad(temp,epoch));
+replyoff+=sprintf(&replybuff[replyoff],"  Epoch Retire Pending ............ %s\r\n",pad(temp,pending));
+replyoff+=sprintf(&replybuff[replyoff],"  Epoch Reclaim Count ............. %s\r\n",pad(temp,freed));
+
+g_stringtable->GetTableSize(count,bytes);
+replyoff+=sprintf(&replybuff[replyoff],"  Interned String Count ........... %s\r\n",pad(temp,count));
+replyoff+=sprintf(&replybuff[replyoff],"  Interned String Bytes ........... %s\r\n",pad(temp,bytes));
+replyoff+=sprintf(&replybuff[replyoff],"  Interned String Overflow ........ %s\r\n",pad(temp,g_stringtable->GetOverflowCount()));
+replyoff+=sprintf(&replybuff[replyoff],"  Session Object Size ............. %s\r\n",pad(temp,(int)sizeof(SessionObject)));
+
 replyoff+=sprintf(&replybuff[replyoff],"  Message Queue Counter ........... %s\r\n",pad(temp,msg_totalcount));
 replyoff+=sprintf(&replybuff[replyoff],"  Message Queue Timeout ........... %s\r\n",pad(temp,msg_timedrop));
 replyoff+=sprintf(&replybuff[replyoff],"  Message Queue Overrun ........... %s\r\n",pad(temp,msg_sizedrop));
 
+	// get the details for each of the wagon pools
+	for(x = 0;x < 3;x++)
+	{
+	if (g_wagonpool[x] == NULL) continue;
+	g_wagonpool[x]->GetPoolStats(hits,misses,idle);
+	replyoff+=sprintf(&replybuff[replyoff],"  Wagon Pool %-6s Hit Count ..... %s\r\n",g_wagonpool[x]->GetPoolName(),pad(temp,hits));
+	replyoff+=sprintf(&replybuff[replyoff],"  Wagon Pool %-6s Miss Count .... %s\r\n",g_wagonpool[x]->GetPoolName(),pad(temp,misses));
+	replyoff+=sprintf(&replybuff[replyoff],"  Wagon Pool %-6s Idle Blocks ... %s\r\n",g_wagonpool[x]->GetPoolName(),pad(temp,idle));
+	}
+
+// get the details and slab usage for the session pool
+g_sessionpool->GetPoolStats(hits,misses,idle);
+replyoff+=sprintf(&replybuff[replyoff],"  Session Pool Hit Count .......... %s\r\n",pad(temp,hits));
+replyoff+=sprintf(&replybuff[replyoff],"  Session Pool Miss Count ......... %s\r\n",pad(temp,misses));
+replyoff+=sprintf(&replybuff[replyoff],"  Session Pool Idle Blocks ........ %s\r\n",pad(temp,idle));
+replyoff+=sprintf(&replybuff[replyoff],"  Session Pool Drop Count ......... %s\r\n",pad(temp,session_dropcount));
+g_sessionpool->GetSlabStats(count,bytes,slabhist);
+replyoff+=sprintf(&replybuff[replyoff],"  Session Pool Slab Count ......... %s\r\n",pad(temp,count));
+replyoff+=sprintf(&replybuff[replyoff],"  Session Pool Slab Bytes ......... %s\r\n",pad(temp,bytes));
+replyoff+=sprintf(&replybuff[replyoff],"  Session Pool Slab Usage ......... ");
+for(x = 0;x < SLAB_HISTOGRAM;x++) replyoff+=sprintf(&replybuff[replyoff],"%s%d%%=%d",(x == 0 ? "" : " "),(x * 100) / (SLAB_HISTOGRAM - 1),slabhist[x]);
+replyoff+=sprintf(&replybuff[replyoff],"\r\n");
+
 	if (g_mfwflag == 0)
 	{
-	// get the details for the message queue
-	g_messagequeue->GetQueueSize(count,bytes,hicnt,himem);
+	// get the combined details for all of the message queues
+	count = bytes = hicnt = himem = 0;
+
+		for(x = 0;x < g_classify_count;x++)
+		{
+		g_messagequeue[x]->GetQueueSize(c,b,hc,hm);
+		count+=c;
+		bytes+=b;
+		if (hc > hicnt) hicnt = hc;
+		if (hm > himem) himem = hm;
+		}
+
+	replyoff+=sprintf(&replybuff[replyoff],"  Classify Thread Count ........... %s\r\n",pad(temp,g_classify_count));
 	replyoff+=sprintf(&replybuff[replyoff],"  Message Queue Current Count ..... %s\r\n",pad(temp,count));
 	replyoff+=sprintf(&replybuff[replyoff],"  Message Queue Current Bytes ..... %s\r\n",pad(temp,bytes));
 	replyoff+=sprintf(&replybuff[replyoff],"  Message Queue Highest Count ..... %s\r\n",pad(temp,hicnt));
@@ -625,6 +1633,19 @@ replyoff+=sprintf(&replybuff[replyoff],"  Message Queue Overrun ........... %s\r
 	g_sessiontable->GetTableSize(count,bytes);
 	replyoff+=sprintf(&replybuff[replyoff],"  Session Hash Table Items ........ %s\r\n",pad(temp,count));
 	replyoff+=sprintf(&replybuff[replyoff],"  Session Hash Table Bytes ........ %s\r\n",pad(temp,bytes));
+
+	// get the load and chain length histogram for the session table
+	g_sessiontable->GetLoadStats(count,load,histogram);
+	replyoff+=sprintf(&replybuff[replyoff],"  Session Hash Table Buckets ...... %s\r\n",pad(temp,count));
+	replyoff+=sprintf(&replybuff[replyoff],"  Session Hash Table Load ......... %.3f\r\n",load);
+	replyoff+=sprintf(&replybuff[replyoff],"  Session Hash Table Chains ....... ");
+	for(x = 0;x < TABLE_HISTOGRAM;x++) replyoff+=sprintf(&replybuff[replyoff],"%s%d%s=%d",(x == 0 ? "" : " "),x,(x == (TABLE_HISTOGRAM - 1) ? "+" : ""),histogram[x]);
+	replyoff+=sprintf(&replybuff[replyoff],"\r\n");
+
+	// get the number of session timers and how many have expired
+	g_timerwheel->GetWheelStats(count,expired);
+	replyoff+=sprintf(&replybuff[replyoff],"  Session Timer Count ............. %s\r\n",pad(temp,count));
+	replyoff+=sprintf(&replybuff[replyoff],"  Session Timer Expired ........... %s\r\n",pad(temp,expired));
 	}
 
 replyoff+=sprintf(&replybuff[replyoff],"  Vineyard EPROTONOSUPPORT Errors . %s\r\n",pad(temp,err_protonosupport));
@@ -651,7 +1672,10 @@ void NetworkClient::BuildProtoList(int complete)
 char    temp[64];
 int             x;
 
-replyoff = sprintf(replybuff,"===== VINEYARD %s APPLICATION LIST =====\r\n",(complete ? "COMPLETE" : "DETECTED"));
+// make sure there is room for every protocol in the list
+ReserveReply((g_protocount * 64) + 256);
+
+replyoff+=sprintf(&replybuff[replyoff],"===== VINEYARD %s APPLICATION LIST =====\r\n",(complete ? "COMPLETE" : "DETECTED"));
 
         for(x = 0;x < g_protocount;x++)
         {
@@ -662,7 +1686,7 @@ replyoff = sprintf(replybuff,"===== VINEYARD %s APPLICATION LIST =====\r\n",(com
 /*--------------------------------------------------------------------------*/
 void NetworkClient::BuildConfiguration(void)
 {
-replyoff = sprintf(replybuff,"========== CLASSD CONFIGURATION ==========\r\n");
+replyoff+=sprintf(&replybuff[replyoff],"========== CLASSD CONFIGURATION ==========\r\n");
 
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_LOG_PATH ................ %s\r\n",cfg_log_path);
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_LOG_FILE ................ %s\r\n",cfg_log_file);
@@ -672,12 +1696,19 @@ replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_PLUGIN_PATH ............. %s\r\
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_LIBRARY_DEBUG ........... %d\r\n",cfg_navl_debug);
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_MEMORY_LIMIT ............ %d\r\n",cfg_mem_limit);
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_HASH_BUCKETS ............ %d\r\n",cfg_hash_buckets);
+replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_SESSION_TABLE ........... %s\r\n",cfg_session_table);
+replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_CLASSIFY_THREADS ........ %d\r\n",cfg_classify_threads);
+replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_IO_THREADS .............. %d\r\n",cfg_io_threads);
+replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_RESULT_TABLE ............ %s\r\n",cfg_result_table);
+replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_RESULT_ENTRIES .......... %d\r\n",cfg_result_entries);
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_IP_DEFRAG ............... %d\r\n",cfg_navl_defrag);
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_TCP_TIMEOUT ............. %d\r\n",cfg_tcp_timeout);
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_UDP_TIMEOUT ............. %d\r\n",cfg_udp_timeout);
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_IP_TIMEOUT .............. %d\r\n",cfg_ip_timeout);
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_HTTP_LIMIT .............. %d\r\n",cfg_http_limit);
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_CLIENT_PORT ............. %d\r\n",cfg_client_port);
+replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_STREAM_SOCKET ........... %s\r\n",cfg_stream_socket);
+replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_PACKET_SOCKET ........... %s\r\n",cfg_packet_socket);
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_PACKET_TIMEOUT .......... %d\r\n",cfg_packet_timeout);
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_PACKET_MAXIMUM .......... %d\r\n",cfg_packet_maximum);
 replyoff+=sprintf(&replybuff[replyoff],"  CLASSD_FACEBOOK_SUBCLASS ....... %d\r\n",cfg_facebook_subclass);
@@ -693,7 +1724,7 @@ replyoff+=sprintf(&replybuff[replyoff],"\r\n");
 /*--------------------------------------------------------------------------*/
 void NetworkClient::BuildHelpPage(void)
 {
-replyoff = sprintf(replybuff,"========== HELP PAGE ==========\r\n");
+replyoff+=sprintf(&replybuff[replyoff],"========== HELP PAGE ==========\r\n");
 
 replyoff+=sprintf(&replybuff[replyoff],"CONFIG = display all daemon configuration values\r\n");
 replyoff+=sprintf(&replybuff[replyoff],"DEBUG = display daemon debug information\r\n");
@@ -706,6 +1737,11 @@ replyoff+=sprintf(&replybuff[replyoff],"+PACKET | -PACKET = enable/disable netwo
 replyoff+=sprintf(&replybuff[replyoff],"+SESSION | -SESSION = enable/disable netfilter session table logging\r\n");
 replyoff+=sprintf(&replybuff[replyoff],"DUMP = dump low level debug information to file\r\n");
 replyoff+=sprintf(&replybuff[replyoff],"HELP = display this spiffy help page\r\n");
+replyoff+=sprintf(&replybuff[replyoff],"BINARY = switch the connection to the binary protocol\r\n");
+replyoff+=sprintf(&replybuff[replyoff],"LOOKUP|id|id|... = search the connection table for many sessions\r\n");
+replyoff+=sprintf(&replybuff[replyoff],"SUBSCRIBE | UNSUBSCRIBE = enable/disable classification change events\r\n");
+replyoff+=sprintf(&replybuff[replyoff],"SHMRING = attach a shared memory chunk ring passed over a local socket\r\n");
+replyoff+=sprintf(&replybuff[replyoff],"NOREPLY | REPLY = disable/enable replies to CREATE, REMOVE, and chunk commands\r\n");
 replyoff+=sprintf(&replybuff[replyoff],"EXIT or QUIT = disconnect the session\r\n");
 replyoff+=sprintf(&replybuff[replyoff],"\nAll other requests will search the connection table\r\n\r\n");
 }
@@ -714,6 +1750,7 @@ void NetworkClient::DumpEverything(void)
 {
 FILE	*stream;
 char	dumpfile[256];
+int		start,x;
 
 // create the dump file
 sprintf(dumpfile,"%s/classd-dump.txt",cfg_dump_path);
@@ -721,19 +1758,26 @@ stream = fopen(dumpfile,"a");
 
 	if (stream == NULL)
 	{
-	replyoff = sprintf(replybuff,"UNABLE TO CREATE TEMPORARY FILE\r\n");
+	replyoff+=sprintf(&replybuff[replyoff],"UNABLE TO CREATE TEMPORARY FILE\r\n");
 	return;
 	}
 
 fputs("##############################################################################\r\n",stream);
 
+// the debug and configuration details are built in the reply buffer
+// following any replies that are still waiting to be sent so we
+// write them to the file and then discard them
+start = replyoff;
+
 // dump the debug information
 BuildDebugInfo();
-fputs(replybuff,stream);
+fputs(&replybuff[start],stream);
+replyoff = start;
 
 // dump the daemon configuration
 BuildConfiguration();
-fputs(replybuff,stream);
+fputs(&replybuff[start],stream);
+replyoff = start;
 
 	// if the mfwflag is not set dump everything in the session hash table
 	if (g_mfwflag == 0)
@@ -747,10 +1791,10 @@ fputs(replybuff,stream);
 fflush(stream);
 fclose(stream);
 
-	// if the mfwflag is clear tell the classify thread to dump the vineyard debug info
+	// if the mfwflag is clear tell the classify threads to dump the vineyard debug info
 	if (g_mfwflag == 0)
 	{
-	g_messagequeue->PushMessage(new MessageWagon(MSG_DEBUG,dumpfile));
+	for(x = 0;x < g_classify_count;x++) g_messagequeue[x]->PushMessage(new MessageWagon(MSG_DEBUG,dumpfile));
 	}
 
 	// in MFW mode we call the debug function directly
@@ -759,7 +1803,7 @@ fclose(stream);
 	vineyard_debug(dumpfile);
 	}
 
-replyoff = sprintf(replybuff,"========== DUMP FILE CREATED ==========\r\n");
+replyoff+=sprintf(&replybuff[replyoff],"========== DUMP FILE CREATED ==========\r\n");
 replyoff+=sprintf(&replybuff[replyoff],"  FILE: %s\r\n",dumpfile);
 }
 /*--------------------------------------------------------------------------*/
@@ -7,13 +7,20 @@
 #include "common.h"
 #include "classd.h"
 /*--------------------------------------------------------------------------*/
-NetworkServer::NetworkServer(void)
+NetworkServer::NetworkServer(int aIndex)
 {
 struct sockaddr_in	addr;
+struct epoll_event	evt;
 int					ret,val;
 
 // initialize our member variables
 ClientList = NULL;
+DeadList = NULL;
+serverindex = aIndex;
+eventsock = -1;
+pollsock = -1;
+streamsock = -1;
+packetsock = -1;
 
 // initialize the thread control semaphore so we start suspended
 sem_init(&ThreadSignal,0,0);
@@ -42,6 +49,22 @@ ret = setsockopt(netsock,SOL_SOCKET,SO_REUSEADDR,(char *)&val,sizeof(val));
 	return;
 	}
 
+	// when running multiple server threads each one has its own listen
+	// socket bound to the same port and the kernel spreads the inbound
+	// connections between them
+	if (g_netserver_count > 1)
+	{
+	val = 1;
+	ret = setsockopt(netsock,SOL_SOCKET,SO_REUSEPORT,(char *)&val,sizeof(val));
+
+		if (ret == -1)
+		{
+		sysmessage(LOG_ERR,"Error %d returned from network setsockopt(SO_REUSEPORT)\n",errno);
+		g_shutdown = 1;
+		return;
+		}
+	}
+
 // set the socket to non blocking mode
 ret = fcntl(netsock,F_SETFL,O_NONBLOCK);
 
@@ -67,7 +90,7 @@ ret = bind(netsock,(struct sockaddr *)&addr,sizeof(addr));
 	}
 
 // listen for incomming connections
-ret = listen(netsock,8);
+ret = listen(netsock,SOMAXCONN);
 
 	if (ret == -1)
 	{
@@ -76,6 +99,91 @@ ret = listen(netsock,8);
 	return;
 	}
 
+// create the epoll instance for the server and client sockets
+pollsock = epoll_create1(EPOLL_CLOEXEC);
+
+	if (pollsock == -1)
+	{
+	sysmessage(LOG_ERR,"Error %d returned from epoll_create1()\n",errno);
+	g_shutdown = 1;
+	return;
+	}
+
+// add the server socket using a null pointer to identify it
+memset(&evt,0,sizeof(evt));
+evt.events = (EPOLLIN | EPOLLET);
+evt.data.ptr = NULL;
+ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,netsock,&evt);
+
+	if (ret == -1)
+	{
+	sysmessage(LOG_ERR,"Error %d returned from epoll_ctl(netsock)\n",errno);
+	g_shutdown = 1;
+	return;
+	}
+
+// create the eventfd the classify threads use to wake us up
+// when there are classification events for our subscribers
+eventsock = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (eventsock == -1)
+	{
+	sysmessage(LOG_ERR,"Error %d returned from eventfd()\n",errno);
+	g_shutdown = 1;
+	return;
+	}
+
+// add the eventfd using our own pointer to identify it
+memset(&evt,0,sizeof(evt));
+evt.events = (EPOLLIN | EPOLLET);
+evt.data.ptr = this;
+ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,eventsock,&evt);
+
+	if (ret == -1)
+	{
+	sysmessage(LOG_ERR,"Error %d returned from epoll_ctl(eventsock)\n",errno);
+	g_shutdown = 1;
+	return;
+	}
+
+// The optional local sockets are created in main and shared by all of
+// the servers.  Unix sockets don't support SO_REUSEPORT balancing so
+// every server watches the same listen sockets with EPOLLEXCLUSIVE
+// which wakes only one of them for each new connection.
+streamsock = g_streamsock;
+packetsock = g_packetsock;
+
+	// add the local sockets using pointers to the member variables
+	// that hold them so the worker can tell them apart from clients
+	if (streamsock >= 0)
+	{
+	memset(&evt,0,sizeof(evt));
+	evt.events = (EPOLLIN | EPOLLET | EPOLLEXCLUSIVE);
+	evt.data.ptr = &streamsock;
+	ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,streamsock,&evt);
+
+		if (ret == -1)
+		{
+		sysmessage(LOG_ERR,"Error %d returned from epoll_ctl(streamsock)\n",errno);
+		g_shutdown = 1;
+		return;
+		}
+	}
+
+	if (packetsock >= 0)
+	{
+	memset(&evt,0,sizeof(evt));
+	evt.events = (EPOLLIN | EPOLLET | EPOLLEXCLUSIVE);
+	evt.data.ptr = &packetsock;
+	ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,packetsock,&evt);
+
+		if (ret == -1)
+		{
+		sysmessage(LOG_ERR,"Error %d returned from epoll_ctl(packetsock)\n",errno);
+		g_shutdown = 1;
+		return;
+		}
+	}
 }
 /*--------------------------------------------------------------------------*/
 NetworkServer::~NetworkServer(void)
@@ -89,6 +197,9 @@ sem_post(&ThreadSignal);
 // wait for the thread to finish
 pthread_join(ThreadHandle,NULL);
 
+// delete any clients removed during the last batch of events
+PurgeClients();
+
 	// delete any active clients
 	for(curr = ClientList;curr != NULL;)
 	{
@@ -106,6 +217,10 @@ pthread_join(ThreadHandle,NULL);
 	ret = close(netsock);
 	if (ret != 0) sysmessage(LOG_ERR,"Error %d returned from close()\n",errno);
 	}
+
+// clean up the eventfd and epoll instance
+if (eventsock >= 0) close(eventsock);
+if (pollsock >= 0) close(pollsock);
 }
 /*--------------------------------------------------------------------------*/
 void* NetworkServer::ThreadMaster(void *argument)
@@ -148,17 +263,16 @@ sem_post(&ThreadSignal);
 /*--------------------------------------------------------------------------*/
 void* NetworkServer::ThreadWorker(void)
 {
-NetworkClient		*local,*curr,*next;
-struct timeval		tv;
-fd_set				tester;
-int					ret,val,max;
+struct epoll_event	events[64];
+NetworkClient		*local;
+int					ret,val,tot,x;
 
-sysmessage(LOG_INFO,"The netserver thread is starting\n");
+sysmessage(LOG_INFO,"The netserver thread %d is starting\n",serverindex);
 
 	// when running on MFW we have to handle the vineyard startup
 	if (g_mfwflag != 0)
 	{
-	ret = vineyard_startup();
+	ret = vineyard_startup(serverindex);
 		if (ret != 0)
 		{
 		sysmessage(LOG_ERR,"Error %d returned from vineyard_startup()\n",ret);
@@ -174,55 +288,62 @@ sysmessage(LOG_INFO,"The netserver thread is starting\n");
 	if (ret != 0) break;
 	if (val != 0) break;
 
-	// clear our set and add the main server socket
-	FD_ZERO(&tester);
-	FD_SET(netsock,&tester);
-	max = netsock;
+	// wait for something to happen
+	tot = epoll_wait(pollsock,events,64,1000);
+	if (tot < 1) continue;
 
-		// add each network client to the set
-		for(local = ClientList;local != NULL;local = local->next)
+		for(x = 0;x < tot;x++)
 		{
-		FD_SET(local->netsock,&tester);
-		if (local->netsock > max) max = local->netsock;
-		}
+		local = (NetworkClient *)events[x].data.ptr;
 
-	// wait for something to happen
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
-	ret = select(max+1,&tester,NULL,NULL,&tv);
-	if (ret < 1) continue;
+			// handle new client connections
+			if (local == NULL)
+			{
+			AcceptClients(netsock);
+			continue;
+			}
 
-		// handle new client connections
-		if (FD_ISSET(netsock,&tester) != 0)
-		{
-			try
+			// handle new local socket connections
+			if (events[x].data.ptr == &streamsock)
 			{
-			local = new NetworkClient(netsock);
+			AcceptClients(streamsock);
+			continue;
 			}
 
-			catch(Problem *err)
+			if (events[x].data.ptr == &packetsock)
 			{
-			if (err->string != NULL) sysmessage(LOG_WARNING,"%s CODE:%d\n",err->string,err->value);
-			delete(err);
-			local = NULL;
+			AcceptClients(packetsock);
+			continue;
 			}
 
-		if (local != NULL) InsertClient(local);
-		}
+			// handle events for subscribed clients
+			if (events[x].data.ptr == this)
+			{
+			HandleEvents();
+			continue;
+			}
 
-		// check all the network clients for activity
-		for(curr = ClientList;curr != NULL;)
-		{
-		next = curr->next;
+			// skip clients removed earlier in this batch of events
+			if (local->deadflag != 0) continue;
 
-			if (FD_ISSET(curr->netsock,&tester) != 0)
+			// clients that hang up or have an error without
+			// anything left to read can be removed directly
+			if ((events[x].events & (EPOLLERR | EPOLLHUP)) && !(events[x].events & EPOLLIN))
 			{
-			ret = curr->NetworkHandler();
-			if (ret == 0) RemoveClient(curr);
+			RemoveClient(local);
+			continue;
 			}
 
-		curr = next;
+		// let the client handle the activity inside an epoch
+		// so the sessions it finds in the table stay valid
+		g_epochmanager->EnterEpoch();
+		ret = local->NetworkHandler();
+		g_epochmanager->LeaveEpoch();
+		if (ret == 0) RemoveClient(local);
 		}
+
+	// nothing in the batch can reference removed clients any more
+	PurgeClients();
 	}
 
 	// when running on MFW we have to handle the vineyard shutdown
@@ -231,45 +352,190 @@ sysmessage(LOG_INFO,"The netserver thread is starting\n");
 	vineyard_shutdown();
 	}
 
-sysmessage(LOG_INFO,"The netserver thread has finished\n");
+sysmessage(LOG_INFO,"The netserver thread %d has finished\n",serverindex);
 return(NULL);
 }
 /*--------------------------------------------------------------------------*/
-void NetworkServer::InsertClient(NetworkClient *aClient)
+void NetworkServer::AcceptClients(int aSock)
 {
-// insert the new client at the front of the linked list
-aClient->next = ClientList;
-ClientList = aClient;
+NetworkClient		*local;
+
+	// the server socket is edge triggered so we have to
+	// accept connections until there are none left
+	for(;;)
+	{
+		try
+		{
+		local = new NetworkClient(aSock);
+		}
+
+		catch(Problem *err)
+		{
+		if (err->string != NULL) sysmessage(LOG_WARNING,"%s CODE:%d\n",err->string,err->value);
+		delete(err);
+		local = NULL;
+		}
+
+	if (local == NULL) break;
+	InsertClient(local);
+	}
 }
 /*--------------------------------------------------------------------------*/
-void NetworkServer::RemoveClient(NetworkClient *aClient)
+int NetworkServer::CreateLocalSocket(int aType,const char *aPath)
 {
-NetworkClient	*work,*prev;
+struct sockaddr_un	addr;
+socklen_t			size;
+int					sock,ret;
 
-// start with empty previous pointer
-prev = NULL;
+sock = socket(AF_UNIX,aType | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
 
-	// walk through the list and look for a match
-	for(work = ClientList;work != NULL;work = work->next)
+	if (sock == -1)
 	{
-		// if we find it pull it out of the chain and delete
-		if (work == aClient)
-		{
-		// if item being deleted is first pull out front of list
-		if (work == ClientList) ClientList = work->next;
+	sysmessage(LOG_ERR,"Error %d returned from socket(%s)\n",errno,aPath);
+	g_shutdown = 1;
+	return(-1);
+	}
 
-		// otherwise pull out of the middle of the list
-		else if (prev != NULL) prev->next = work->next;
+memset(&addr,0,sizeof(addr));
+addr.sun_family = AF_UNIX;
 
-		// delete the item we pulled out of the linked list
-		delete(work);
+	// a leading @ puts the socket in the abstract namespace where the
+	// name starts with a null and the length is given by the address size
+	if (aPath[0] == '@')
+	{
+	strncpy(&addr.sun_path[1],&aPath[1],sizeof(addr.sun_path) - 2);
+	size = offsetof(struct sockaddr_un,sun_path) + strlen(aPath);
+	}
 
-		// break out of the loop
-		break;
-		}
+	// otherwise remove any socket file left behind by a previous instance
+	else
+	{
+	strncpy(addr.sun_path,aPath,sizeof(addr.sun_path) - 1);
+	size = sizeof(addr);
+	unlink(aPath);
+	}
+
+ret = bind(sock,(struct sockaddr *)&addr,size);
+
+	if (ret == -1)
+	{
+	sysmessage(LOG_ERR,"Error %d returned from bind(%s)\n",errno,aPath);
+	close(sock);
+	g_shutdown = 1;
+	return(-1);
+	}
+
+ret = listen(sock,SOMAXCONN);
 
-	// save current pointer as previous
-	prev = work;
+	if (ret == -1)
+	{
+	sysmessage(LOG_ERR,"Error %d returned from listen(%s)\n",errno,aPath);
+	close(sock);
+	g_shutdown = 1;
+	return(-1);
+	}
+
+sysmessage(LOG_INFO,"Listening for local clients on %s\n",aPath);
+return(sock);
+}
+/*--------------------------------------------------------------------------*/
+void NetworkServer::HandleEvents(void)
+{
+NetworkClient		*local,*next;
+u_int64_t			value;
+int					ret;
+
+// clear the eventfd counter
+ret = read(eventsock,&value,sizeof(value));
+if (ret != sizeof(value)) return;
+
+	// format the events for each of our subscribers that has them
+	// and let the client handler send them along with any replies
+	for(local = NetworkClient::GrabEvents(eventsock);local != NULL;local = next)
+	{
+	next = local->nextready;
+	local->nextready = NULL;
+
+	// skip clients removed earlier in this batch of events and
+	// leave their grabbed events for the client destructor
+	if (local->deadflag != 0) continue;
+
+	local->FormatEvents();
+	g_epochmanager->EnterEpoch();
+	ret = local->NetworkHandler();
+	g_epochmanager->LeaveEpoch();
+	if (ret == 0) RemoveClient(local);
+	}
+}
+/*--------------------------------------------------------------------------*/
+void NetworkServer::InsertClient(NetworkClient *aClient)
+{
+struct epoll_event	evt;
+int					ret;
+
+// set the client socket to non blocking mode
+ret = fcntl(aClient->netsock,F_SETFL,O_NONBLOCK);
+
+	if (ret == -1)
+	{
+	sysmessage(LOG_ERR,"Error %d returned from client fcntl(O_NONBLOCK)\n",errno);
+	delete(aClient);
+	return;
+	}
+
+// clients need our eventfd so classify threads can wake us up
+aClient->eventsock = eventsock;
+
+// add the client socket to the epoll instance watching for both read and
+// write since edge triggered write events only fire when a full socket
+// buffer drains which is exactly when a pending reply can be resumed
+memset(&evt,0,sizeof(evt));
+evt.events = (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+evt.data.ptr = aClient;
+ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,aClient->netsock,&evt);
+
+	if (ret == -1)
+	{
+	sysmessage(LOG_ERR,"Error %d returned from epoll_ctl(client)\n",errno);
+	delete(aClient);
+	return;
+	}
+
+// insert the new client at the front of the linked list
+aClient->prev = NULL;
+aClient->next = ClientList;
+if (ClientList != NULL) ClientList->prev = aClient;
+ClientList = aClient;
+}
+/*--------------------------------------------------------------------------*/
+void NetworkServer::RemoveClient(NetworkClient *aClient)
+{
+// remove the client socket from the epoll instance
+epoll_ctl(pollsock,EPOLL_CTL_DEL,aClient->netsock,NULL);
+
+// pull the client out of the linked list
+if (aClient->prev != NULL) aClient->prev->next = aClient->next;
+else ClientList = aClient->next;
+if (aClient->next != NULL) aClient->next->prev = aClient->prev;
+
+// The events array from epoll_wait and the list of clients with events
+// ready can still hold the client so we only mark it dead here and put
+// it on the dead list to be deleted once the current batch is finished.
+aClient->deadflag = 1;
+aClient->Unsubscribe();
+aClient->next = DeadList;
+DeadList = aClient;
+}
+/*--------------------------------------------------------------------------*/
+void NetworkServer::PurgeClients(void)
+{
+NetworkClient		*curr;
+
+	while (DeadList != NULL)
+	{
+	curr = DeadList;
+	DeadList = curr->next;
+	delete(curr);
 	}
 }
 /*--------------------------------------------------------------------------*/
@@ -0,0 +1,169 @@
+// RESULTS.CPP
+// Traffic Classification Engine
+// Copyright (c) 2011-2018 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+#include "classd.h"
+
+// Marks a slot that is being claimed or cleared.  Readers never match it
+// and writers only claim slots where the session is zero.
+static const u_int64_t RESULT_RESERVED = 0xFFFFFFFFFFFFFFFFULL;
+/*--------------------------------------------------------------------------*/
+ResultTable::ResultTable(const char *aPath,int aEntries)
+{
+void		*memory;
+char		*names;
+int			entries,bits,ret,fd,x;
+
+// round the number of entries up to a power of two within sane limits
+entries = 1024;
+bits = 10;
+
+	while ((entries < aEntries) && (bits < 24))
+	{
+	entries<<=1;
+	bits++;
+	}
+
+tablemask = (entries - 1);
+tableshift = (64 - bits);
+tablesize = (sizeof(ResultHeader) + (entries * sizeof(ResultEntry)) + (g_protocount * 16));
+snprintf(tablepath,sizeof(tablepath),"%s",aPath);
+
+fd = open(tablepath,O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+if (fd < 0) throw(new Problem("Error returned from open(result table)",errno));
+
+ret = ftruncate(fd,tablesize);
+
+	if (ret != 0)
+	{
+	ret = errno;
+	close(fd);
+	throw(new Problem("Error returned from ftruncate(result table)",ret));
+	}
+
+// the mapping stays valid after we close the file
+memory = mmap(NULL,tablesize,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+ret = errno;
+close(fd);
+if (memory == MAP_FAILED) throw(new Problem("Error returned from mmap(result table)",ret));
+
+tablehead = (ResultHeader *)memory;
+tabledata = (ResultEntry *)((char *)memory + sizeof(ResultHeader));
+names = ((char *)tabledata + (entries * sizeof(ResultEntry)));
+
+// copy the protocol names so readers can translate the protocol ids
+for(x = 0;x < g_protocount;x++) strncpy(&names[x * 16],g_protostats[x]->protocol_name,15);
+
+tablehead->entries = entries;
+tablehead->probes = RESULT_PROBES;
+tablehead->protocount = g_protocount;
+
+// the magic value is set last so readers know the table is ready
+__atomic_store_n(&tablehead->magic,RESULT_MAGIC,__ATOMIC_RELEASE);
+
+sysmessage(LOG_INFO,"Publishing %d session results in %s\n",entries,tablepath);
+}
+/*--------------------------------------------------------------------------*/
+ResultTable::~ResultTable(void)
+{
+// clear the magic so anyone with the table mapped knows it is stale
+__atomic_store_n(&tablehead->magic,0,__ATOMIC_RELEASE);
+
+munmap(tablehead,tablesize);
+unlink(tablepath);
+}
+/*--------------------------------------------------------------------------*/
+ResultEntry *ResultTable::FindEntry(u_int64_t aSession,u_int64_t aMatch)
+{
+ResultEntry		*local;
+u_int64_t		slot;
+int				x;
+
+slot = ((aSession * 0x9E3779B97F4A7C15ULL) >> tableshift);
+
+	for(x = 0;x < RESULT_PROBES;x++)
+	{
+	local = &tabledata[(slot + x) & tablemask];
+	if (__atomic_load_n(&local->session,__ATOMIC_ACQUIRE) == aMatch) return(local);
+	}
+
+return(NULL);
+}
+/*--------------------------------------------------------------------------*/
+void ResultTable::UpdateResult(u_int64_t aSession,int aApplication,const u_int16_t *aChain,int aLength,int aConfidence,int aState)
+{
+ResultEntry		*local;
+u_int64_t		slot,empty;
+int				x;
+
+if ((aSession == 0) || (aSession == RESULT_RESERVED)) return;
+
+// every session is owned by a single classify thread so if we find
+// the session we can update the entry without any other checks
+local = FindEntry(aSession,aSession);
+
+	// otherwise we have to claim an empty slot which may race with
+	// the other classify threads looking for one of their own
+	if (local == NULL)
+	{
+	slot = ((aSession * 0x9E3779B97F4A7C15ULL) >> tableshift);
+
+		for(x = 0;x < RESULT_PROBES;x++)
+		{
+		local = &tabledata[(slot + x) & tablemask];
+		empty = 0;
+		if (__atomic_compare_exchange_n(&local->session,&empty,RESULT_RESERVED,0,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED) != 0) break;
+		local = NULL;
+		}
+	}
+
+	// if every slot is full the session just doesn't get published
+	if (local == NULL)
+	{
+	__sync_fetch_and_add(&result_dropcount,1);
+	return;
+	}
+
+WriteEntry(local,aSession,aApplication,aChain,aLength,aConfidence,aState);
+}
+/*--------------------------------------------------------------------------*/
+void ResultTable::RemoveResult(u_int64_t aSession)
+{
+ResultEntry		*local;
+
+if ((aSession == 0) || (aSession == RESULT_RESERVED)) return;
+
+local = FindEntry(aSession,aSession);
+if (local == NULL) return;
+
+// clear the entry while holding the slot and then give it back
+WriteEntry(local,RESULT_RESERVED,0,NULL,0,0,0);
+__atomic_store_n(&local->session,0,__ATOMIC_RELEASE);
+}
+/*--------------------------------------------------------------------------*/
+void ResultTable::WriteEntry(ResultEntry *aEntry,u_int64_t aSession,int aApplication,const u_int16_t *aChain,int aLength,int aConfidence,int aState)
+{
+u_int32_t		sequence;
+
+if (aLength > RESULT_CHAIN) aLength = RESULT_CHAIN;
+
+// an odd sequence tells readers the entry is being written
+sequence = __atomic_load_n(&aEntry->sequence,__ATOMIC_RELAXED);
+__atomic_store_n(&aEntry->sequence,sequence + 1,__ATOMIC_RELAXED);
+__atomic_thread_fence(__ATOMIC_RELEASE);
+
+aEntry->state = aState;
+aEntry->confidence = aConfidence;
+aEntry->application = aApplication;
+aEntry->chain_length = aLength;
+if (aLength != 0) memcpy(aEntry->protochain,aChain,aLength * sizeof(u_int16_t));
+memset(&aEntry->protochain[aLength],0,(RESULT_CHAIN - aLength) * sizeof(u_int16_t));
+__atomic_store_n(&aEntry->session,aSession,__ATOMIC_RELAXED);
+
+// the even sequence publishes the new contents
+__atomic_store_n(&aEntry->sequence,sequence + 2,__ATOMIC_RELEASE);
+}
+/*--------------------------------------------------------------------------*/
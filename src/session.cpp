@@ -14,21 +14,13 @@ SessionObject::SessionObject(u_int64_t aSession,
 {
 state = 0;
 confidence = 0;
-
-application_str[0][0] = 0;
-application_str[1][0] = 0;
-application_idx = 0;
-
-protochain_str[0][0] = 0;
-protochain_str[1][0] = 0;
-protochain_idx = 0;
-
-detail_str[0][0] = 0;
-detail_str[1][0] = 0;
-detail_idx = 0;
+application = 0;
+protochain = 0;
+detail = NULL;
+appcopy = NULL;
+chaincopy = NULL;
 
 vinestat = NULL;
-wipeflag = 0;
 
 if (aClient != NULL) memcpy(&clientinfo,aClient,sizeof(clientinfo));
 else memset(&clientinfo,0,sizeof(clientinfo));
@@ -46,6 +38,28 @@ if (aProtocol == IPPROTO_IPV6) UpdateObject("IP6","/IP6",0,NAVL_STATE_INSPECTING
 /*--------------------------------------------------------------------------*/
 SessionObject::~SessionObject(void)
 {
+// sessions are only deleted once nobody can be looking at the strings
+if (detail != NULL) free(detail);
+if (appcopy != NULL) free(appcopy);
+if (chaincopy != NULL) free(chaincopy);
+}
+/*--------------------------------------------------------------------------*/
+void* SessionObject::operator new(size_t aSize)
+{
+void		*block;
+
+// the pool blocks are sized for a session so anything bigger won't fit
+if (aSize > (size_t)g_sessionpool->GetBlockSize()) throw std::bad_alloc();
+
+block = g_sessionpool->GrabBlock();
+if (block == NULL) throw std::bad_alloc();
+return(block);
+}
+/*--------------------------------------------------------------------------*/
+void SessionObject::operator delete(void *aObject)
+{
+if (aObject == NULL) return;
+g_sessionpool->FreeBlock(aObject);
 }
 /*--------------------------------------------------------------------------*/
 void SessionObject::UpdateObject(const char *aApplication,
@@ -53,47 +67,126 @@ void SessionObject::UpdateObject(const char *aApplication,
 	short aConfidence,
 	short aState)
 {
-int		anext,pnext;
-int		len;
+u_int16_t	appid,chainid;
+int			changed;
+
+changed = 0;
+
+// the names are interned so we only have to store the ids and
+// changed is bumped when we have to replace our own copy of a name
+appid = InternString(aApplication,&appcopy,changed);
+chainid = InternString(aProtochain,&chaincopy,changed);
+
+StoreObject(appid,chainid,aConfidence,aState,changed);
+}
+/*--------------------------------------------------------------------------*/
+void SessionObject::UpdateObject(u_int16_t aApplication,
+	u_int16_t aProtochain,
+	short aConfidence,
+	short aState)
+{
+// the classify thread has already interned the names for us
+StoreObject(aApplication,aProtochain,aConfidence,aState,0);
+}
+/*--------------------------------------------------------------------------*/
+void SessionObject::StoreObject(u_int16_t aApplication,u_int16_t aProtochain,short aConfidence,short aState,int aChanged)
+{
+int		changed;
 
 ResetTimeout();
 
-anext = (application_idx ^ 1);
-pnext = (protochain_idx ^ 1);
+changed = aChanged;
+
+	// only look for changes when somebody has subscribed to events and
+	// skip the initial values set when the object is constructed
+	if ((g_subscriber_count != 0) && (application != 0))
+	{
+	if (aApplication != application) changed++;
+	if (aProtochain != protochain) changed++;
+	if (aConfidence != confidence) changed++;
+	if (aState != state) changed++;
+	}
 
-// copy the updated application to the inactive buffer and toggle the index
-len = strlen(aApplication);
-if (len >= (int)sizeof(application_str[anext])) len = (sizeof(application_str[anext]) - 1);
-memcpy(application_str[anext],aApplication,len);
-application_str[anext][len] = 0;
-application_idx ^= 1;
+	else changed = 0;
 
-// copy the updated protochain to the inactive buffer and toggle the index
-len = strlen(aProtochain);
-if (len >= (int)sizeof(protochain_str[pnext])) len = (sizeof(protochain_str[pnext]) - 1);
-memcpy(protochain_str[pnext],aProtochain,len);
-protochain_str[pnext][len] = 0;
-protochain_idx ^= 1;
+// the ids are stored atomically so readers always get a valid string
+__atomic_store_n(&application,aApplication,__ATOMIC_RELEASE);
+__atomic_store_n(&protochain,aProtochain,__ATOMIC_RELEASE);
 
 confidence = aConfidence;
 state = aState;
+
+// let the subscribers know something changed
+if (changed != 0) NetworkClient::PublishEvent(this);
+}
+/*--------------------------------------------------------------------------*/
+u_int16_t SessionObject::InternString(const char *aString,char **aCopy,int &aChanged)
+{
+u_int16_t	id;
+char		*local,*prev;
+
+id = g_stringtable->InsertString(aString);
+if (id != STRING_OVERFLOW) return(id);
+
+// The string table is full so we keep our own copy of the string.  The
+// copy is stored before the caller stores the id so readers that see
+// the overflow id always find it, and it is left in place if the id
+// changes back so we only have to replace it when the string changes.
+prev = *aCopy;
+if ((prev != NULL) && (strcmp(prev,aString) == 0)) return(id);
+
+local = strdup(aString);
+prev = __atomic_exchange_n(aCopy,local,__ATOMIC_ACQ_REL);
+g_epochmanager->RetireMemory(prev);
+aChanged++;
+
+return(id);
 }
 /*--------------------------------------------------------------------------*/
 void SessionObject::UpdateDetail(const char *aDetail)
 {
-int		dnext;
-int		len;
+char	*local,*prev;
 
 ResetTimeout();
 
-dnext = (detail_idx ^ 1);
+// nothing to do if the detail hasn't changed
+if (strcmp(aDetail,GetDetail()) == 0) return;
+
+// Most sessions never have any detail so it is stored separately only
+// when it is set.  Other threads may be reading the old string so it is
+// retired and only freed once they can no longer be using it.
+local = (aDetail[0] == 0 ? NULL : strndup(aDetail,255));
+prev = __atomic_exchange_n(&detail,local,__ATOMIC_ACQ_REL);
+g_epochmanager->RetireMemory(prev);
+
+// let the subscribers know something changed
+if (g_subscriber_count != 0) NetworkClient::PublishEvent(this);
+}
+/*--------------------------------------------------------------------------*/
+const char *SessionObject::GetApplication(void)
+{
+u_int16_t	id;
 
-// copy the updated detail to the inactive buffer and toggle the index
-len = strlen(aDetail);
-if (len >= (int)sizeof(detail_str[dnext])) len = (sizeof(detail_str[dnext]) - 1);
-memcpy(detail_str[dnext],aDetail,len);
-detail_str[dnext][len] = 0;
-detail_idx ^= 1;
+id = __atomic_load_n(&application,__ATOMIC_ACQUIRE);
+if (id == STRING_OVERFLOW) return(__atomic_load_n(&appcopy,__ATOMIC_ACQUIRE));
+return(g_stringtable->GetString(id));
+}
+/*--------------------------------------------------------------------------*/
+const char *SessionObject::GetProtochain(void)
+{
+u_int16_t	id;
+
+id = __atomic_load_n(&protochain,__ATOMIC_ACQUIRE);
+if (id == STRING_OVERFLOW) return(__atomic_load_n(&chaincopy,__ATOMIC_ACQUIRE));
+return(g_stringtable->GetString(id));
+}
+/*--------------------------------------------------------------------------*/
+const char *SessionObject::GetDetail(void)
+{
+const char	*local;
+
+local = __atomic_load_n(&detail,__ATOMIC_ACQUIRE);
+return(local == NULL ? "" : local);
 }
 /*--------------------------------------------------------------------------*/
 int SessionObject::GetObjectSize(void)
@@ -101,19 +194,16 @@ int SessionObject::GetObjectSize(void)
 int			mysize;
 
 mysize = HashObject::GetObjectSize();
+if (detail != NULL) mysize+=(strlen(detail) + 1);
+if (appcopy != NULL) mysize+=(strlen(appcopy) + 1);
+if (chaincopy != NULL) mysize+=(strlen(chaincopy) + 1);
 return(mysize);
 }
 /*--------------------------------------------------------------------------*/
 char *SessionObject::GetObjectString(char *target,int maxlen)
 {
-const char		*local;
-
-if (detail_str[detail_idx] == NULL) local = "";
-else local = detail_str[detail_idx];
-
-snprintf(target,maxlen,"%s [%d|%d|%s|%s|%s]",GetNetString(),state,confidence,application_str[application_idx],protochain_str[protochain_idx],local);
+snprintf(target,maxlen,"%" PRIu64 " [%d|%d|%s|%s|%s]",GetNetSession(),state,confidence,GetApplication(),GetProtochain(),GetDetail());
 
 return(target);
 }
 /*--------------------------------------------------------------------------*/
-
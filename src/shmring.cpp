@@ -0,0 +1,257 @@
+// SHMRING.CPP
+// Traffic Classification Engine
+// Copyright (c) 2011-2018 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+#include "classd.h"
+/*--------------------------------------------------------------------------*/
+PacketRing::PacketRing(int aMemory,int aSignal,const char *aName)
+{
+struct stat		info;
+void			*memory;
+u_int32_t		size;
+int				ret;
+
+// initialize our member variables
+ringhead = NULL;
+ringdata = NULL;
+ringsize = 0;
+ringmask = 0;
+tailpos = 0;
+memsock = aMemory;
+signalsock = aSignal;
+snprintf(ringname,sizeof(ringname),"%s",aName);
+
+// the memfd must at least be large enough for the header
+ret = fstat(memsock,&info);
+if (ret != 0) throw(new Problem("Error returned from fstat(memfd)",errno));
+if (info.st_size < (off_t)sizeof(RingHeader)) throw(new Problem("Invalid shared memory ring size",(int)info.st_size));
+
+// map the whole memfd so we can check the header
+memory = mmap(NULL,info.st_size,PROT_READ | PROT_WRITE,MAP_SHARED,memsock,0);
+if (memory == MAP_FAILED) throw(new Problem("Error returned from mmap(memfd)",errno));
+
+ringhead = (RingHeader *)memory;
+ringsize = info.st_size;
+size = ringhead->size;
+
+	// the ring data size must be a sane power of two that fits in the memfd
+	if ((ringhead->magic != RING_MAGIC) || (size < (u_int32_t)RING_MINIMUM) || (size > (u_int32_t)RING_MAXIMUM) ||
+		((size & (size - 1)) != 0) || ((size_t)size > (ringsize - sizeof(RingHeader))))
+	{
+	munmap(memory,ringsize);
+	throw(new Problem("Invalid shared memory ring header",(int)size));
+	}
+
+ringdata = ((char *)memory + sizeof(RingHeader));
+ringmask = (size - 1);
+
+// we start reading wherever the producer says we left off
+tailpos = __atomic_load_n(&ringhead->tail,__ATOMIC_ACQUIRE);
+
+// initialize the thread control semaphore so we start suspended
+sem_init(&ThreadSignal,0,0);
+
+// spin up a new thread
+ret = pthread_create(&ThreadHandle,NULL,ThreadMaster,this);
+
+	// the caller still owns the descriptors so we only undo our own work
+	if (ret != 0)
+	{
+	sem_destroy(&ThreadSignal);
+	munmap(memory,ringsize);
+	throw(new Problem("Error returned from pthread_create(shmring)",ret));
+	}
+}
+/*--------------------------------------------------------------------------*/
+PacketRing::~PacketRing(void)
+{
+u_int64_t		value;
+int				ret;
+
+// set the thread signal semaphore
+sem_post(&ThreadSignal);
+
+// ring the doorbell so the thread doesn't sit in poll until the timeout
+// since we are running on a netserver thread with other clients waiting
+value = 1;
+ret = write(signalsock,&value,sizeof(value));
+if (ret != sizeof(value)) LOGMESSAGE(CAT_CLIENT,LOG_DEBUG,"SHMRING WAKEUP FAILED: %s\n",ringname);
+
+// wait for the thread to finish
+pthread_join(ThreadHandle,NULL);
+
+sem_destroy(&ThreadSignal);
+munmap(ringhead,ringsize);
+close(signalsock);
+close(memsock);
+}
+/*--------------------------------------------------------------------------*/
+void* PacketRing::ThreadMaster(void *argument)
+{
+PacketRing		*mypointer = (PacketRing *)argument;
+sigset_t		sigset;
+void			*retval;
+
+// set the itimer value of the main thread which is required
+// for gprof to work properly with multithreaded applications
+setitimer(ITIMER_PROF,&g_itimer,NULL);
+
+// start by masking all signals
+sigfillset(&sigset);
+pthread_sigmask(SIG_BLOCK,&sigset,NULL);
+
+// now we allow only the PROF signal
+sigemptyset(&sigset);
+sigaddset(&sigset,SIGPROF);
+sigaddset(&sigset,SIGALRM);
+pthread_sigmask(SIG_UNBLOCK,&sigset,NULL);
+
+// wait for the control semaphore so we don't start
+// running before the constructor has finished
+sem_wait(&mypointer->ThreadSignal);
+
+// pass execution to our member worker function which
+// will not return until our destructor is called
+retval = mypointer->ThreadWorker();
+
+// return to caller
+return(retval);
+}
+/*--------------------------------------------------------------------------*/
+void PacketRing::BeginExecution(void)
+{
+// signal the thread
+sem_post(&ThreadSignal);
+}
+/*--------------------------------------------------------------------------*/
+void* PacketRing::ThreadWorker(void)
+{
+int		ret,val;
+
+LOGMESSAGE(CAT_CLIENT,LOG_DEBUG,"SHMRING STARTING: %s\n",ringname);
+
+	while (g_shutdown == 0)
+	{
+	// watch the thread signal for termination
+	val = 0;
+	ret = sem_getvalue(&ThreadSignal,&val);
+	if (ret != 0) break;
+	if (val != 0) break;
+
+	// pass everything in the ring to the classify threads
+	ret = ConsumeRecords();
+
+		// the ring is shared with the client so if it gives us garbage
+		// we stop reading since we can't trust anything that follows
+		if (ret < 0)
+		{
+		sysmessage(LOG_WARNING,"Invalid shared memory ring record from netclient %s\n",ringname);
+		__sync_fetch_and_add(&ring_errorcount,1);
+		break;
+		}
+
+	// wait for the producer if the ring was empty
+	if (ret == 0) WaitRecords();
+	}
+
+LOGMESSAGE(CAT_CLIENT,LOG_DEBUG,"SHMRING FINISHED: %s\n",ringname);
+return(NULL);
+}
+/*--------------------------------------------------------------------------*/
+int PacketRing::ConsumeRecords(void)
+{
+BinaryHeader	header;
+MessageWagon	*wagon;
+u_int64_t		headpos,offset,space;
+u_int8_t		message;
+int				count;
+
+headpos = __atomic_load_n(&ringhead->head,__ATOMIC_ACQUIRE);
+if ((headpos - tailpos) > (ringmask + 1)) return(-1);
+
+count = 0;
+
+	while (tailpos != headpos)
+	{
+	offset = (tailpos & ringmask);
+	space = ((ringmask + 1) - offset);
+
+	// the producer can't change a record until we advance the tail but
+	// we copy the header so we only look at the fields once either way
+	if (space < sizeof(header)) return(-1);
+	if ((headpos - tailpos) < sizeof(header)) return(-1);
+	memcpy(&header,&ringdata[offset],sizeof(header));
+
+		// a zero opcode means the rest of the ring is padding
+		if (header.opcode == 0)
+		{
+		if ((headpos - tailpos) < space) return(-1);
+		tailpos+=space;
+		continue;
+		}
+
+	message = 0;
+	if (header.opcode == BIN_CLIENT) message = MSG_CLIENT;
+	if (header.opcode == BIN_SERVER) message = MSG_SERVER;
+	if (header.opcode == BIN_PACKET) message = MSG_PACKET;
+	if (message == 0) return(-1);
+
+	// records can't wrap around the end of the ring
+	if (header.length > (u_int32_t)CHUNK_MAXIMUM) return(-1);
+	if ((sizeof(header) + header.length) > space) return(-1);
+	if ((headpos - tailpos) < (sizeof(header) + header.length)) return(-1);
+
+	// copy the chunk into a wagon and pass it to the classify thread
+	wagon = new(header.length) MessageWagon(message,header.session,header.length);
+	memcpy(wagon->buffer,&ringdata[offset + sizeof(header)],header.length);
+	classify_dispatch(wagon);
+
+	tailpos+=((sizeof(header) + header.length + RING_ALIGN - 1) & ~(u_int64_t)(RING_ALIGN - 1));
+	count++;
+
+		// give the space back to the producer every so often
+		// so a large backlog doesn't fill the ring while we work
+		if ((count & 63) == 0)
+		{
+		__atomic_store_n(&ringhead->tail,tailpos,__ATOMIC_RELEASE);
+		}
+	}
+
+__atomic_store_n(&ringhead->tail,tailpos,__ATOMIC_RELEASE);
+if (count != 0) __sync_fetch_and_add(&ring_totalcount,count);
+
+// return one if there was anything in the ring
+return(count != 0 ? 1 : 0);
+}
+/*--------------------------------------------------------------------------*/
+void PacketRing::WaitRecords(void)
+{
+struct pollfd	pfd;
+u_int64_t		value;
+int				ret;
+
+// Let the producer know we are going to sleep and then check the head
+// once more since it may have added a record before seeing the flag.
+__atomic_store_n(&ringhead->sleeping,1,__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ringhead->head,__ATOMIC_SEQ_CST) != tailpos)
+	{
+	__atomic_store_n(&ringhead->sleeping,0,__ATOMIC_RELAXED);
+	return;
+	}
+
+// wait for the doorbell with a timeout so we notice shutdown
+pfd.fd = signalsock;
+pfd.events = POLLIN;
+pfd.revents = 0;
+ret = poll(&pfd,1,1000);
+
+// clear the eventfd counter
+if (ret > 0) ret = read(signalsock,&value,sizeof(value));
+
+__atomic_store_n(&ringhead->sleeping,0,__ATOMIC_RELAXED);
+}
+/*--------------------------------------------------------------------------*/
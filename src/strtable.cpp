@@ -0,0 +1,236 @@
+// STRTABLE.CPP
+// Traffic Classification Engine
+// Copyright (c) 2011-2018 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+#include "classd.h"
+/*--------------------------------------------------------------------------*/
+StringTable::StringTable(int aLimit)
+{
+// the hash index is kept at most half full and the number of strings
+// has to fit in a sixteen bit id that can't be the overflow marker
+stringlimit = (aLimit > STRING_OVERFLOW ? STRING_OVERFLOW : aLimit);
+for(indexmask = 1;indexmask < (unsigned)(stringlimit * 2);indexmask<<=1);
+indexmask--;
+
+stringlist = (char **)calloc(stringlimit,sizeof(char *));
+indexlist = (u_int32_t *)calloc(indexmask + 1,sizeof(u_int32_t));
+stringbytes = 0;
+
+// every chain maps to one of the strings so the same limit works
+chainlist = (ChainEntry **)calloc(stringlimit,sizeof(ChainEntry *));
+chainindex = (u_int32_t *)calloc(indexmask + 1,sizeof(u_int32_t));
+chaincount = 0;
+chainbytes = 0;
+
+fullflag = 0;
+overflowcount = 0;
+
+pthread_mutex_init(&stringlock,NULL);
+
+// string zero is always the empty string
+stringlist[0] = strdup("");
+stringcount = 1;
+}
+/*--------------------------------------------------------------------------*/
+StringTable::~StringTable(void)
+{
+int		x;
+
+for(x = 0;x < stringcount;x++) free(stringlist[x]);
+free(stringlist);
+free(indexlist);
+
+for(x = 0;x < chaincount;x++) free(chainlist[x]);
+free(chainlist);
+free(chainindex);
+
+pthread_mutex_destroy(&stringlock);
+}
+/*--------------------------------------------------------------------------*/
+u_int32_t StringTable::GetHashValue(const char *aString)
+{
+u_int32_t	hash;
+
+// FNV-1a is plenty for the short strings we keep here
+for(hash = 0x811C9DC5;*aString != 0;aString++) hash = ((hash ^ (u_int8_t)*aString) * 0x01000193);
+return(hash);
+}
+/*--------------------------------------------------------------------------*/
+u_int32_t StringTable::GetChainHash(const u_int16_t *aChain,int aLength)
+{
+u_int32_t	hash;
+int			x;
+
+// same FNV-1a as the strings but fed both bytes of each protocol index
+hash = 0x811C9DC5;
+
+	for(x = 0;x < aLength;x++)
+	{
+	hash = ((hash ^ (aChain[x] & 0xFF)) * 0x01000193);
+	hash = ((hash ^ (aChain[x] >> 8)) * 0x01000193);
+	}
+
+return(hash);
+}
+/*--------------------------------------------------------------------------*/
+int StringTable::FindString(const char *aString,u_int32_t aHash)
+{
+u_int32_t	slot,value;
+
+	// The index holds the string id plus one so zero is an empty slot.
+	// Slots and strings are never changed once they are set so we don't
+	// need any locks to search and the probe stops at the first empty.
+	for(slot = (aHash & indexmask);;slot = ((slot + 1) & indexmask))
+	{
+	value = __atomic_load_n(&indexlist[slot],__ATOMIC_ACQUIRE);
+	if (value == 0) return(-(int)slot - 1);
+	if (strcmp(stringlist[value - 1],aString) == 0) return(value - 1);
+	}
+}
+/*--------------------------------------------------------------------------*/
+int StringTable::FindChain(const u_int16_t *aChain,int aLength,u_int32_t aHash)
+{
+ChainEntry	*entry;
+u_int32_t	slot,value;
+
+	// works just like FindString but compares the protocol indexes
+	for(slot = (aHash & indexmask);;slot = ((slot + 1) & indexmask))
+	{
+	value = __atomic_load_n(&chainindex[slot],__ATOMIC_ACQUIRE);
+	if (value == 0) return(-(int)slot - 1);
+	entry = chainlist[value - 1];
+	if (entry->length != aLength) continue;
+	if (memcmp(entry->chain,aChain,aLength * sizeof(u_int16_t)) == 0) return(entry->string);
+	}
+}
+/*--------------------------------------------------------------------------*/
+void StringTable::FormatChain(const u_int16_t *aChain,int aLength,char *aBuffer,int aSize)
+{
+const char	*name;
+int			off,x;
+
+aBuffer[0] = 0;
+off = 0;
+
+	// protocol indexes that were out of bounds are stored as the count
+	for(x = 0;(x < aLength) && (off < aSize);x++)
+	{
+	name = (aChain[x] >= g_protocount ? "???" : g_protostats[aChain[x]]->protocol_name);
+	off+=snprintf(&aBuffer[off],aSize - off,"/%s",name);
+	}
+}
+/*--------------------------------------------------------------------------*/
+u_int16_t StringTable::InsertString(const char *aString)
+{
+u_int32_t	hash;
+char		*local;
+int			ret;
+
+// the empty string is always id zero
+if (aString[0] == 0) return(0);
+
+// most of the time the string is already in the table
+hash = GetHashValue(aString);
+ret = FindString(aString,hash);
+if (ret >= 0) return(ret);
+
+pthread_mutex_lock(&stringlock);
+
+// search again now that nobody else can be adding
+ret = FindString(aString,hash);
+
+	if (ret >= 0)
+	{
+	pthread_mutex_unlock(&stringlock);
+	return(ret);
+	}
+
+	// Strings are never removed so a long running daemon could eventually
+	// fill the table.  When that happens we complain once and return the
+	// overflow marker so the caller keeps its own copy of the string.
+	if (stringcount == stringlimit)
+	{
+	if (fullflag == 0) sysmessage(LOG_WARNING,"The string table is full with %d entries - new strings will be stored in each session\n",stringcount);
+	fullflag = 1;
+	overflowcount++;
+	pthread_mutex_unlock(&stringlock);
+	return(STRING_OVERFLOW);
+	}
+
+local = strdup(aString);
+stringbytes+=(strlen(local) + 1);
+
+// store the string before the index slot makes it visible to searches
+stringlist[stringcount] = local;
+__atomic_store_n(&indexlist[-ret - 1],stringcount + 1,__ATOMIC_RELEASE);
+ret = stringcount++;
+
+pthread_mutex_unlock(&stringlock);
+
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+u_int16_t StringTable::InsertChain(const u_int16_t *aChain,int aLength,char *aBuffer,int aSize)
+{
+ChainEntry	*local;
+u_int32_t	hash;
+u_int16_t	id;
+int			ret,size;
+
+// most of the time we have seen the chain before
+hash = GetChainHash(aChain,aLength);
+ret = FindChain(aChain,aLength,hash);
+if (ret >= 0) return(ret);
+
+// otherwise build the string for the chain and intern that and if the
+// table is full the caller can use the string we left in the buffer
+FormatChain(aChain,aLength,aBuffer,aSize);
+id = InsertString(aBuffer);
+if (id == STRING_OVERFLOW) return(id);
+
+pthread_mutex_lock(&stringlock);
+
+// search again now that nobody else can be adding
+ret = FindChain(aChain,aLength,hash);
+
+	// we still have the string id if there is no room for the chain
+	if ((ret >= 0) || (chaincount == stringlimit))
+	{
+	pthread_mutex_unlock(&stringlock);
+	return(id);
+	}
+
+size = (sizeof(ChainEntry) + (aLength * sizeof(u_int16_t)));
+local = (ChainEntry *)malloc(size);
+local->string = id;
+local->length = aLength;
+memcpy(local->chain,aChain,aLength * sizeof(u_int16_t));
+chainbytes+=size;
+
+// store the entry before the index slot makes it visible to searches
+chainlist[chaincount] = local;
+__atomic_store_n(&chainindex[-ret - 1],chaincount + 1,__ATOMIC_RELEASE);
+chaincount++;
+
+pthread_mutex_unlock(&stringlock);
+
+return(id);
+}
+/*--------------------------------------------------------------------------*/
+void StringTable::GetTableSize(int &aCount,int &aBytes)
+{
+pthread_mutex_lock(&stringlock);
+
+aCount = stringcount;
+aBytes = (sizeof(*this) + stringbytes);
+aBytes+=(stringlimit * sizeof(char *));
+aBytes+=((indexmask + 1) * sizeof(u_int32_t));
+aBytes+=(chainbytes + (stringlimit * sizeof(ChainEntry *)));
+aBytes+=((indexmask + 1) * sizeof(u_int32_t));
+
+pthread_mutex_unlock(&stringlock);
+}
+/*--------------------------------------------------------------------------*/
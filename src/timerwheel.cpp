@@ -0,0 +1,258 @@
+// TIMERWHEEL.CPP
+// Traffic Classification Engine
+// Copyright (c) 2011-2018 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+#include "classd.h"
+
+// Each level covers TIMER_SLOTS times the span of the level below so the
+// four levels reach about 194 days with one second slots at the bottom.
+static const int TIMER_MASK = (TIMER_SLOTS - 1);
+static const time_t TIMER_SPAN = ((time_t)1 << (TIMER_BITS * TIMER_LEVELS));
+/*--------------------------------------------------------------------------*/
+TimerWheel::TimerWheel(time_t aStamp)
+{
+int		x,y;
+
+	for(x = 0;x < TIMER_LEVELS;x++)
+	{
+	for(y = 0;y < TIMER_SLOTS;y++) wheel[x][y] = NULL;
+	}
+
+wheeltime = aStamp;
+entrycount = 0;
+expiredcount = 0;
+
+pthread_mutex_init(&wheellock,NULL);
+}
+/*--------------------------------------------------------------------------*/
+TimerWheel::~TimerWheel(void)
+{
+TimerEntry	*work,*hold;
+int			x,y;
+
+	// free all the entries still in the wheel
+	for(x = 0;x < TIMER_LEVELS;x++)
+	{
+		for(y = 0;y < TIMER_SLOTS;y++)
+		{
+			for(work = wheel[x][y];work != NULL;work = hold)
+			{
+			hold = work->next;
+			free(work);
+			}
+		}
+	}
+
+pthread_mutex_destroy(&wheellock);
+}
+/*--------------------------------------------------------------------------*/
+void TimerWheel::InsertTimer(HashObject *aObject)
+{
+TimerEntry	*entry;
+
+// The entry holds the session id and object pointer so we can tell if
+// the object is still in the table when the timer fires without having
+// to pull the entry out of the wheel every time a session is deleted.
+entry = (TimerEntry *)malloc(sizeof(TimerEntry));
+entry->object = aObject;
+entry->session = aObject->GetNetSession();
+entry->expires = aObject->GetTimeout();
+
+pthread_mutex_lock(&wheellock);
+InsertEntry(entry);
+pthread_mutex_unlock(&wheellock);
+
+__sync_fetch_and_add(&entrycount,1);
+}
+/*--------------------------------------------------------------------------*/
+void TimerWheel::InsertEntry(TimerEntry *aEntry)
+{
+time_t		when,delta;
+int			level,slot;
+
+// anything already due fires on the next tick
+when = aEntry->expires;
+if (when <= wheeltime) when = (wheeltime + 1);
+
+// anything too far in the future goes in the last slot it can reach
+// and will be put back in the wheel when it fires if it is still alive
+delta = (when - wheeltime);
+if (delta >= TIMER_SPAN) when = (wheeltime + TIMER_SPAN - 1);
+
+// find the lowest level with slots that span the time remaining
+for(level = 0;level < (TIMER_LEVELS - 1);level++) if (delta < ((time_t)1 << (TIMER_BITS * (level + 1)))) break;
+
+slot = ((when >> (TIMER_BITS * level)) & TIMER_MASK);
+aEntry->next = wheel[level][slot];
+wheel[level][slot] = aEntry;
+}
+/*--------------------------------------------------------------------------*/
+void TimerWheel::CascadeLevel(int aLevel)
+{
+TimerEntry	*work,*hold;
+int			slot;
+
+// move everything in the slot for the current time down to lower levels
+slot = ((wheeltime >> (TIMER_BITS * aLevel)) & TIMER_MASK);
+work = wheel[aLevel][slot];
+wheel[aLevel][slot] = NULL;
+
+	while (work != NULL)
+	{
+	hold = work->next;
+	InsertEntry(work);
+	work = hold;
+	}
+}
+/*--------------------------------------------------------------------------*/
+int TimerWheel::AdvanceWheel(time_t aStamp)
+{
+TimerEntry	*list;
+int			removed,level;
+
+removed = 0;
+
+// if the clock jumped we start over from the current time
+if ((aStamp < wheeltime) || ((aStamp - wheeltime) > TIMER_SLOTS)) RebaseWheel(aStamp - 1);
+
+	// process every second since the last time we were called
+	while (wheeltime < aStamp)
+	{
+	pthread_mutex_lock(&wheellock);
+
+	wheeltime++;
+
+	// when a level wraps pull the next slot down from each level above
+	// starting at the top so entries can fall through several levels
+	for(level = 1;level < TIMER_LEVELS;level++) if ((wheeltime & (((time_t)1 << (TIMER_BITS * level)) - 1)) != 0) break;
+	for(level = (level - 1);level > 0;level--) CascadeLevel(level);
+
+	// grab everything that is due this second
+	list = wheel[0][wheeltime & TIMER_MASK];
+	wheel[0][wheeltime & TIMER_MASK] = NULL;
+
+	pthread_mutex_unlock(&wheellock);
+
+	if (list != NULL) removed+=ExpireEntries(list);
+	}
+
+return(removed);
+}
+/*--------------------------------------------------------------------------*/
+void TimerWheel::RebaseWheel(time_t aStamp)
+{
+TimerEntry	*list,*work,*hold;
+int			x,y;
+
+list = NULL;
+
+pthread_mutex_lock(&wheellock);
+
+	// pull every entry out of the wheel
+	for(x = 0;x < TIMER_LEVELS;x++)
+	{
+		for(y = 0;y < TIMER_SLOTS;y++)
+		{
+			for(work = wheel[x][y];work != NULL;work = hold)
+			{
+			hold = work->next;
+			work->next = list;
+			list = work;
+			}
+
+		wheel[x][y] = NULL;
+		}
+	}
+
+sysmessage(LOG_NOTICE,"Clock change detected - moving session timers from %ld to %ld\n",(long)wheeltime,(long)aStamp);
+
+// put everything back relative to the new time and anything with a
+// timeout from before the jump will be checked on the next tick
+wheeltime = aStamp;
+
+	for(work = list;work != NULL;work = hold)
+	{
+	hold = work->next;
+	InsertEntry(work);
+	}
+
+pthread_mutex_unlock(&wheellock);
+}
+/*--------------------------------------------------------------------------*/
+int TimerWheel::ExpireEntries(TimerEntry *aList)
+{
+TimerEntry	*work,*hold,*again;
+HashObject	*find;
+int			removed,freed;
+
+removed = freed = 0;
+again = NULL;
+
+// stay in an epoch while we look at the sessions we find
+g_epochmanager->EnterEpoch();
+
+	for(work = aList;work != NULL;work = hold)
+	{
+	hold = work->next;
+	find = g_sessiontable->SearchObject(work->session);
+
+		// if the object is gone or the session id belongs to a newer
+		// object which has a timer of its own we just drop the entry
+		if (find != work->object)
+		{
+		free(work);
+		freed++;
+		continue;
+		}
+
+		// the session has seen traffic since the timer was set so
+		// put it back in the wheel using the updated timeout
+		if (wheeltime < find->GetTimeout())
+		{
+		work->expires = find->GetTimeout();
+		work->next = again;
+		again = work;
+		continue;
+		}
+
+	// Object is stale so post a remove message to the owning classify
+	// thread.  The message is dropped if the queue is full so we keep the
+	// timer and try again later, and it only gets freed above once the
+	// classify thread has actually pulled the session out of the table.
+	classify_dispatch(new MessageWagon(MSG_REMOVE,work->session));
+	work->expires = (wheeltime + TIMER_RETRY);
+	work->next = again;
+	again = work;
+	removed++;
+	}
+
+g_epochmanager->LeaveEpoch();
+
+	// put back the timers for sessions that are still in the table
+	if (again != NULL)
+	{
+	pthread_mutex_lock(&wheellock);
+
+		for(work = again;work != NULL;work = hold)
+		{
+		hold = work->next;
+		InsertEntry(work);
+		}
+
+	pthread_mutex_unlock(&wheellock);
+	}
+
+__sync_fetch_and_sub(&entrycount,freed);
+__sync_fetch_and_add(&expiredcount,removed);
+return(removed);
+}
+/*--------------------------------------------------------------------------*/
+void TimerWheel::GetWheelStats(int &aCount,u_int64_t &aExpired)
+{
+aCount = __atomic_load_n(&entrycount,__ATOMIC_RELAXED);
+aExpired = __atomic_load_n(&expiredcount,__ATOMIC_RELAXED);
+}
+/*--------------------------------------------------------------------------*/
@@ -0,0 +1,127 @@
+/*
+	This utility compares the old modulo session hash with the murmur3
+	mixing hash used by the session tables.  It shows how evenly each
+	one spreads a few patterns of session ids across the buckets, and
+	how long it takes to turn a session id into a bucket index.  Build
+	it on each target with something like gcc -O2 -o hashbench hashbench.c
+	and pass the number of buckets and lookups to override the defaults.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef unsigned long long u64;
+
+unsigned	buckets = 1024;
+unsigned	lookups = 50000000;
+unsigned	*counter;
+
+/*--------------------------------------------------------------------------*/
+static inline u64 session_hash(u64 value)
+{
+value ^= (value >> 33);
+value *= 0xFF51AFD7ED558CCDULL;
+value ^= (value >> 33);
+value *= 0xC4CEB9FE1A85EC53ULL;
+value ^= (value >> 33);
+return(value);
+}
+/*--------------------------------------------------------------------------*/
+static double elapsed(struct timespec *start)
+{
+struct timespec		now;
+
+clock_gettime(CLOCK_MONOTONIC,&now);
+return(((now.tv_sec - start->tv_sec) * 1000000000.0) + (now.tv_nsec - start->tv_nsec));
+}
+/*--------------------------------------------------------------------------*/
+static void distribution(const char *name,u64 base,u64 stride,unsigned size,int mixed)
+{
+double		mean,total,diff;
+unsigned	empty,most,x;
+u64			value,key;
+
+for(x = 0;x < size;x++) counter[x] = 0;
+
+	// load the table to an average chain length of one
+	for(x = 0;x < size;x++)
+	{
+	value = (base + (x * stride));
+	if (mixed != 0) key = (session_hash(value) & (size - 1));
+	else key = (value % size);
+	counter[key]++;
+	}
+
+mean = 1.0;
+total = 0.0;
+empty = most = 0;
+
+	for(x = 0;x < size;x++)
+	{
+	if (counter[x] == 0) empty++;
+	if (counter[x] > most) most = counter[x];
+	diff = (counter[x] - mean);
+	total+=(diff * diff);
+	}
+
+printf("  %-12s %-8s size:%-8u empty:%-8u longest:%-6u variance:%.3f\n",name,(mixed != 0 ? "mix" : "modulo"),size,empty,most,total / size);
+}
+/*--------------------------------------------------------------------------*/
+int main(int argc,char *argv[])
+{
+struct timespec		start;
+volatile unsigned	size;
+double				modtime,mixtime;
+u64					value,total;
+unsigned			prime,x;
+
+if (argc > 1) buckets = atoi(argv[1]);
+if (argc > 2) lookups = atoi(argv[2]);
+
+// the mixing hash needs a power of two and the modulo used a prime
+for(size = 1;size < buckets;size<<=1);
+buckets = size;
+for(prime = (buckets - 1);prime > 2;prime--)
+	{
+	for(x = 2;(x * x) <= prime;x++) if ((prime % x) == 0) break;
+	if ((x * x) > prime) break;
+	}
+
+counter = (unsigned *)calloc(buckets,sizeof(unsigned));
+
+printf("DISTRIBUTION\n");
+distribution("sequential",0x12340000ULL,1,prime,0);
+distribution("sequential",0x12340000ULL,1,buckets,0);
+distribution("sequential",0x12340000ULL,1,buckets,1);
+distribution("stride-16",0x12340000ULL,16,prime,0);
+distribution("stride-16",0x12340000ULL,16,buckets,0);
+distribution("stride-16",0x12340000ULL,16,buckets,1);
+distribution("high-bits",0x12340000ULL,0x100000000ULL,prime,0);
+distribution("high-bits",0x12340000ULL,0x100000000ULL,buckets,0);
+distribution("high-bits",0x12340000ULL,0x100000000ULL,buckets,1);
+
+// the size is volatile so the compiler can't turn the modulo into
+// a multiply and the sum keeps the loops from being optimized away
+printf("LOOKUP COST\n");
+
+total = 0;
+value = 0x5555555512345678ULL;
+size = prime;
+clock_gettime(CLOCK_MONOTONIC,&start);
+for(x = 0;x < lookups;x++) total+=((value + x) % size);
+modtime = (elapsed(&start) / lookups);
+
+value = 0x5555555512345678ULL;
+size = buckets;
+clock_gettime(CLOCK_MONOTONIC,&start);
+for(x = 0;x < lookups;x++) total+=(session_hash(value + x) & (size - 1));
+mixtime = (elapsed(&start) / lookups);
+
+printf("  modulo ........ %.3f ns\n",modtime);
+printf("  mix ........... %.3f ns\n",mixtime);
+printf("  checksum ...... %llu\n",total);
+
+free(counter);
+return(0);
+}